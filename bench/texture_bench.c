@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+#include "cpu.h"
+#include "display.h"
+#include "texture.h"
+#include "triangle.h"
+
+// ----- TEXTURE SAMPLING BENCHMARK -----
+// draws a 2048x2048 texture on a quad that covers the window, rotated by 0, 45 and 90
+// degrees, for every texel layout; one thread, no geometry pipeline, only the two textured
+// triangles, so the times are the cost of walking and sampling the texture
+//
+//   make bench && ./texture_bench [texels per pixel] [mipmap] [bilinear]
+//
+// texels per pixel defaults to 1; level 0 is sampled unless mipmap is given, and nearest
+// texels unless bilinear is given; RENDERER_ISA picks the kernels like in the renderer
+
+#define TEXTURE_SIZE 2048
+#define NUM_RUNS 7
+#define FRAMES_PER_RUN 10
+
+static const char* layout_names[] = { "linear", "tiled4", "tiled8", "morton" };
+
+
+// ----- 2048x2048 RGBA TEXTURE WITH DIFFERENT TEXELS EVERYWHERE -----
+// generated rather than loaded, so every run samples the same texels
+static texture_t* create_bench_texture(void) {
+    unsigned char* image = (unsigned char*)malloc(TEXTURE_SIZE * TEXTURE_SIZE * 4);
+    for (int y = 0; y < TEXTURE_SIZE; y++) {
+        for (int x = 0; x < TEXTURE_SIZE; x++) {
+            unsigned char* pixel = &image[(y * TEXTURE_SIZE + x) * 4];
+            pixel[0] = (x * 7) & 0xFF;
+            pixel[1] = (y * 13) & 0xFF;
+            pixel[2] = (x ^ y) & 0xFF;
+            pixel[3] = 0xFF;
+        }
+    }
+    texture_t* texture = create_image_texture(image, TEXTURE_SIZE, TEXTURE_SIZE, 4);
+    free(image);
+    return texture;
+}
+
+
+// ----- BEST TIME OF ONE FRAME OVER SEVERAL RUNS, IN MILLISECONDS -----
+// texture coordinates of the window corners are rotated around the center of the texture;
+// vertices sit at w = 1, so every pixel passes the depth test of a cleared z-buffer
+static double time_rotated_quad(const texture_t* texture, float degrees, float texels_per_pixel, rect_t clip) {
+    float width = get_window_width();
+    float height = get_window_height();
+    float scale = texels_per_pixel * width / TEXTURE_SIZE;
+    float c = cosf(degrees * M_PI / 180) * scale;
+    float s = sinf(degrees * M_PI / 180) * scale;
+
+    float x[4] = { 0, width, width, 0 };
+    float y[4] = { 0, 0, height, height };
+    float u[4];
+    float v[4];
+    for (int i = 0; i < 4; i++) {
+        float px = x[i] / width - 0.5;
+        float py = y[i] / width - 0.5;
+        u[i] = 0.5 + c * px - s * py;
+        v[i] = 0.5 + s * px + c * py;
+    }
+
+    double best = 0;
+    for (int run = 0; run < NUM_RUNS; run++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int frame = 0; frame < FRAMES_PER_RUN; frame++) {
+            clear_z_buffer(clip);
+            draw_textured_triangle(
+                x[0], y[0], 1, u[0], v[0],
+                x[1], y[1], 1, u[1], v[1],
+                x[2], y[2], 1, u[2], v[2],
+                texture, 1, clip
+            );
+            draw_textured_triangle(
+                x[0], y[0], 1, u[0], v[0],
+                x[2], y[2], 1, u[2], v[2],
+                x[3], y[3], 1, u[3], v[3],
+                texture, 1, clip
+            );
+        }
+        double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency() / FRAMES_PER_RUN;
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+
+int main(int argc, char* argv[]) {
+    float texels_per_pixel = 1;
+    bool is_mipmapped = false;
+    bool is_bilinear = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "mipmap") == 0) {
+            is_mipmapped = true;
+        } else if (strcmp(argv[i], "bilinear") == 0) {
+            is_bilinear = true;
+        } else {
+            texels_per_pixel = atof(argv[i]);
+        }
+    }
+
+    init_cpu_isa();
+    init_triangle_kernels();
+    if (!initialize_window()) {
+        return 1;
+    }
+    rect_t clip = get_window_rect();
+
+    set_render_method(RENDER_TEXTURED);
+    set_mipmapping(is_mipmapped);
+    set_texture_filter(is_bilinear ? TEXTURE_FILTER_BILINEAR : TEXTURE_FILTER_NEAREST);
+    select_span_kernels();
+
+    printf("%dx%d texture, %dx%d window, %.2f texels per pixel, %s, %s, ms per frame\n",
+        TEXTURE_SIZE, TEXTURE_SIZE, get_window_width(), get_window_height(), texels_per_pixel,
+        is_mipmapped ? "mipmapped" : "level 0 only", is_bilinear ? "bilinear" : "nearest");
+    printf("layout     0 deg   45 deg   90 deg\n");
+    for (int layout = TEXTURE_LAYOUT_LINEAR; layout <= TEXTURE_LAYOUT_MORTON; layout++) {
+        set_texture_layout(layout);
+        texture_t* texture = create_bench_texture();
+        printf("%-7s", layout_names[layout]);
+        for (int degrees = 0; degrees <= 90; degrees += 45) {
+            printf(" %8.2f", time_rotated_quad(texture, degrees, texels_per_pixel, clip));
+        }
+        printf("\n");
+        free_texture(texture);
+    }
+
+    destroy_window();
+    return 0;
+}
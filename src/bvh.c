@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bvh.h"
+#include "clipping.h"
+
+// ----- BOUNDING VOLUME HIERARCHY OVER WORLD BOUNDS OF ALL SCENE MESHES -----
+// binary tree of axis aligned boxes: every leaf holds one mesh, every inner node the box
+// around its two children, so a whole subtree is culled when its box is outside the frustum
+//
+//                     [ root ]
+//              .----------'----------.
+//          [ node ]              [ node ]
+//         .---'----.            .---'----.
+//    [mesh 2]   [mesh 0]   [mesh 1]   [mesh 3]
+//
+typedef struct {
+    vec3_t min;
+    vec3_t max;
+    int left;                // child nodes, -1 for leaves
+    int right;
+    int parent;              // parent node, -1 for root
+    mesh_t* mesh;            // mesh of leaf nodes, NULL for inner nodes
+} bvh_node_t;
+
+static bvh_node_t* nodes = NULL;
+static int num_nodes = 0;
+static int root = -1;
+static int num_bvh_meshes = 0;
+
+// axis used by compare_mesh_centers while sorting meshes during build
+static int split_axis = 0;
+
+
+static float vec3_component(vec3_t v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+
+static bool vec3_equals(vec3_t a, vec3_t b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+
+static int compare_mesh_centers(const void* a, const void* b) {
+    mesh_t* mesh_a = *(mesh_t**)a;
+    mesh_t* mesh_b = *(mesh_t**)b;
+    float center_a = vec3_component(mesh_a->world_bounds_min, split_axis) + vec3_component(mesh_a->world_bounds_max, split_axis);
+    float center_b = vec3_component(mesh_b->world_bounds_min, split_axis) + vec3_component(mesh_b->world_bounds_max, split_axis);
+    if (center_a != center_b) {
+        return center_a < center_b ? -1 : 1;
+    }
+    // equal centers keep load order so the tree is the same on every run
+    return mesh_a->index - mesh_b->index;
+}
+
+
+static void union_bounds(vec3_t* min, vec3_t* max, vec3_t other_min, vec3_t other_max) {
+    if (other_min.x < min->x) min->x = other_min.x;
+    if (other_min.y < min->y) min->y = other_min.y;
+    if (other_min.z < min->z) min->z = other_min.z;
+    if (other_max.x > max->x) max->x = other_max.x;
+    if (other_max.y > max->y) max->y = other_max.y;
+    if (other_max.z > max->z) max->z = other_max.z;
+}
+
+
+// ----- BUILD SUBTREE FOR meshes[0..count) AND RETURN ITS NODE INDEX -----
+// meshes are split in two halves at the median center along the longest axis of their centers
+static int build_node(mesh_t** meshes, int count, int parent) {
+    int index = num_nodes++;
+    bvh_node_t* node = &nodes[index];
+    node->parent = parent;
+    node->left = -1;
+    node->right = -1;
+    node->mesh = NULL;
+
+    if (count == 1) {
+        node->mesh = meshes[0];
+        node->min = meshes[0]->world_bounds_min;
+        node->max = meshes[0]->world_bounds_max;
+        meshes[0]->bvh_node = index;
+        return index;
+    }
+
+    vec3_t center_min = vec3_mul(vec3_add(meshes[0]->world_bounds_min, meshes[0]->world_bounds_max), 0.5);
+    vec3_t center_max = center_min;
+    for (int i = 1; i < count; i++) {
+        vec3_t center = vec3_mul(vec3_add(meshes[i]->world_bounds_min, meshes[i]->world_bounds_max), 0.5);
+        union_bounds(&center_min, &center_max, center, center);
+    }
+    vec3_t extent = vec3_sub(center_max, center_min);
+    split_axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    qsort(meshes, count, sizeof(mesh_t*), compare_mesh_centers);
+
+    // children are built after the sort, node pointer may not be used across recursion
+    int half = count / 2;
+    int left = build_node(meshes, half, index);
+    int right = build_node(meshes + half, count - half, index);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].min = nodes[left].min;
+    nodes[index].max = nodes[left].max;
+    union_bounds(&nodes[index].min, &nodes[index].max, nodes[right].min, nodes[right].max);
+    return index;
+}
+
+
+// ----- BUILD BVH FROM SCRATCH OVER THE CURRENT WORLD BOUNDS OF ALL MESHES -----
+void build_bvh(void) {
+    num_bvh_meshes = get_num_meshes();
+    num_nodes = 0;
+    root = -1;
+    if (num_bvh_meshes == 0) {
+        return;
+    }
+
+    mesh_t** meshes = (mesh_t**)malloc(sizeof(mesh_t*) * num_bvh_meshes);
+    for (int i = 0; i < num_bvh_meshes; i++) {
+        meshes[i] = get_mesh(i);
+        update_mesh_world_matrix(meshes[i]);
+    }
+
+    // a binary tree with n leaves has n - 1 inner nodes
+    nodes = (bvh_node_t*)realloc(nodes, sizeof(bvh_node_t) * (2 * num_bvh_meshes - 1));
+    root = build_node(meshes, num_bvh_meshes, -1);
+    free(meshes);
+}
+
+
+// ----- REFIT BOXES FROM THE LEAF OF A MOVED MESH UP TO THE ROOT -----
+// tree topology is kept, only boxes on the path of the mesh grow or shrink; the walk stops
+// at the first ancestor whose box does not change
+void refit_bvh_mesh(mesh_t* mesh) {
+    int index = mesh->bvh_node;
+    nodes[index].min = mesh->world_bounds_min;
+    nodes[index].max = mesh->world_bounds_max;
+
+    for (index = nodes[index].parent; index != -1; index = nodes[index].parent) {
+        bvh_node_t* node = &nodes[index];
+        vec3_t min = nodes[node->left].min;
+        vec3_t max = nodes[node->left].max;
+        union_bounds(&min, &max, nodes[node->right].min, nodes[node->right].max);
+        if (vec3_equals(min, node->min) && vec3_equals(max, node->max)) {
+            break;
+        }
+        node->min = min;
+        node->max = max;
+    }
+}
+
+
+// ----- BRING BVH UP TO DATE WITH MOVED AND NEWLY LOADED MESHES, ONCE PER FRAME -----
+void update_bvh(void) {
+    if (get_num_meshes() != num_bvh_meshes) {
+        build_bvh();
+        return;
+    }
+    for (int i = 0; i < num_bvh_meshes; i++) {
+        mesh_t* mesh = get_mesh(i);
+        if (update_mesh_world_matrix(mesh)) {
+            refit_bvh_mesh(mesh);
+        }
+    }
+}
+
+
+static int get_node_frustum_visibility(bvh_node_t* node, mat4_t view_matrix) {
+    vec3_t corners[8];
+    for (int i = 0; i < 8; i++) {
+        vec3_t corner = {
+            .x = (i & 1) ? node->max.x : node->min.x,
+            .y = (i & 2) ? node->max.y : node->min.y,
+            .z = (i & 4) ? node->max.z : node->min.z
+        };
+        corners[i] = vec3_from_vec4(mat4_mul_vec4(view_matrix, vec4_from_vec3(corner)));
+    }
+    return get_box_frustum_visibility(corners);
+}
+
+
+static void cull_node(int index, mat4_t view_matrix, int visibility, bvh_visit_function_t visit_function, void* data) {
+    bvh_node_t* node = &nodes[index];
+
+    // once a box is fully inside, everything below it is inside as well and is not tested again
+    if (visibility != FRUSTUM_INSIDE) {
+        visibility = get_node_frustum_visibility(node, view_matrix);
+        if (visibility == FRUSTUM_OUTSIDE) {
+            return;
+        }
+    }
+
+    if (node->mesh != NULL) {
+        visit_function(node->mesh, visibility, data);
+        return;
+    }
+    cull_node(node->left, view_matrix, visibility, visit_function, data);
+    cull_node(node->right, view_matrix, visibility, visit_function, data);
+}
+
+
+// ----- VISIT MESHES WHOSE WORLD BOUNDS ARE NOT OUTSIDE THE VIEW FRUSTUM -----
+void cull_bvh(mat4_t view_matrix, bvh_visit_function_t visit_function, void* data) {
+    if (root != -1) {
+        cull_node(root, view_matrix, FRUSTUM_INTERSECTING, visit_function, data);
+    }
+}
+
+
+void free_bvh(void) {
+    free(nodes);
+    nodes = NULL;
+    num_nodes = 0;
+    root = -1;
+    num_bvh_meshes = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "matrix.h"
+#include "mesh.h"
+
+// called for every mesh whose world bounds are not outside the frustum, with the
+// FRUSTUM_INTERSECTING or FRUSTUM_INSIDE result of the deepest node that was tested
+typedef void (*bvh_visit_function_t)(mesh_t* mesh, int visibility, void* data);
+
+void build_bvh(void);
+void refit_bvh_mesh(mesh_t* mesh);
+void update_bvh(void);
+void cull_bvh(mat4_t view_matrix, bvh_visit_function_t visit_function, void* data);
+void free_bvh(void);
+
+#endif
@@ -1,6 +1,6 @@
 #include "camera.h"
 
-static camera_t camera;
+static camera_t camera = { .is_view_dirty = true };
 
 void init_camera(vec3_t position, vec3_t direction) {
     camera.position = position;
@@ -8,6 +8,7 @@ void init_camera(vec3_t position, vec3_t direction) {
     camera.forward_velocity = vec3_new(0, 0, 0);
     camera.yaw = 0.0;
     camera.pitch = 0.0;
+    camera.is_view_dirty = true;
 };
 
 vec3_t get_camera_position(void) {
@@ -32,10 +33,12 @@ float get_camera_pitch(void) {
 
 void update_camera_position(vec3_t position) {
     camera.position = position;
+    camera.is_view_dirty = true;
 }
 
 void update_camera_direction(vec3_t direction) {
     camera.direction = direction;
+    camera.is_view_dirty = true;
 }
 
 void update_camera_forward_velocity(vec3_t forward_velocity) {
@@ -44,10 +47,12 @@ void update_camera_forward_velocity(vec3_t forward_velocity) {
 
 void rotate_camera_yaw(float angle) {
     camera.yaw += angle;
+    camera.is_view_dirty = true;
 }
 
 void rotate_camera_pitch(float angle) {
     camera.pitch += angle;
+    camera.is_view_dirty = true;
 }
 
 vec3_t get_camera_lookat_target(void) {
@@ -71,3 +76,19 @@ vec3_t get_camera_lookat_target(void) {
 
     return target;
 }
+
+mat4_t get_camera_view_matrix(void) {
+    // rebuild look at matrix only when the camera moved since the last call
+    if (camera.is_view_dirty) {
+        vec3_t target = get_camera_lookat_target();
+        vec3_t up_direction = vec3_new(0, 1, 0);
+        camera.view_matrix = mat4_look_at(camera.position, target, up_direction);
+        camera.is_view_dirty = false;
+        camera.view_version++;
+    }
+    return camera.view_matrix;
+}
+
+int get_camera_view_version(void) {
+    return camera.view_version;
+}
@@ -1,6 +1,7 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <stdbool.h>
 #include "vector.h"
 #include "matrix.h"
 
@@ -10,6 +11,9 @@ typedef struct {
     vec3_t forward_velocity;
     float yaw;
     float pitch;
+    mat4_t view_matrix;     // cached look at matrix, rebuilt only when camera moved
+    bool is_view_dirty;     // position, yaw or pitch changed since last view matrix
+    int view_version;       // incremented every time view matrix is rebuilt
 } camera_t;
 
 void init_camera(vec3_t position, vec3_t direction);
@@ -28,5 +32,7 @@ void rotate_camera_yaw(float angle);
 void rotate_camera_pitch(float angle);
 
 vec3_t get_camera_lookat_target(void);
+mat4_t get_camera_view_matrix(void);
+int get_camera_view_version(void);
 
 #endif
@@ -3,9 +3,16 @@
 #include "triangle.h"
 
 
-#define NUM_PLANES 6
+#define NUM_PLANES 10
 plane_t frustum_planes[NUM_PLANES];
 
+static int clip_method = CLIP_CAMERA_SPACE;
+
+// guard band factor, 1 means side planes are clipped exactly at the frustum
+static float guard_band = 1.0;
+static float tan_half_fov_x = 0;
+static float tan_half_fov_y = 0;
+
 
 // Frustum planes are defined by a point and a normal vector
 //
@@ -61,6 +68,50 @@ void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+
+	tan_half_fov_x = tan(fov_x / 2);
+	tan_half_fov_y = tan(fov_y / 2);
+	set_guard_band(guard_band);
+}
+
+
+// ----- WIDEN SIDE PLANES OF THE GUARD BAND TO factor TIMES THE FRUSTUM -----
+// triangles that cross a frustum side plane but stay inside the guard band are not clipped,
+// the rasterizer scissors them to the screen; factor 1 turns the guard band off
+void set_guard_band(float factor) {
+	if (factor < 1.0) factor = 1.0;
+	if (factor > MAX_GUARD_BAND) factor = MAX_GUARD_BAND;
+	guard_band = factor;
+
+	// guard band planes go through the camera origin like the frustum side planes,
+	// with the tangent of their half angle scaled by the guard band factor
+	float half_guard_x = atan(tan_half_fov_x * guard_band);
+	float half_guard_y = atan(tan_half_fov_y * guard_band);
+
+	frustum_planes[LEFT_GUARD_PLANE].point = vec3_new(0, 0, 0);
+	frustum_planes[LEFT_GUARD_PLANE].normal = vec3_new(cos(half_guard_x), 0, sin(half_guard_x));
+	frustum_planes[RIGHT_GUARD_PLANE].point = vec3_new(0, 0, 0);
+	frustum_planes[RIGHT_GUARD_PLANE].normal = vec3_new(-cos(half_guard_x), 0, sin(half_guard_x));
+	frustum_planes[TOP_GUARD_PLANE].point = vec3_new(0, 0, 0);
+	frustum_planes[TOP_GUARD_PLANE].normal = vec3_new(0, -cos(half_guard_y), sin(half_guard_y));
+	frustum_planes[BOTTOM_GUARD_PLANE].point = vec3_new(0, 0, 0);
+	frustum_planes[BOTTOM_GUARD_PLANE].normal = vec3_new(0, cos(half_guard_y), sin(half_guard_y));
+}
+
+
+bool is_guard_band_enabled(void) {
+	return guard_band > 1.0;
+}
+
+
+// ----- PLANES A FACE HAS TO BE CLIPPED AGAINST, GIVEN THE OR OF ITS VERTEX OUTCODES -----
+// with the guard band only near and far are clipped exactly, side planes are replaced by
+// the wider guard band planes and only the triangles that leave the guard band get clipped
+int get_clip_planes(int outcode) {
+	if (is_guard_band_enabled()) {
+		return outcode & (NEAR_FAR_PLANES | ALL_GUARD_PLANES);
+	}
+	return outcode & ALL_FRUSTUM_PLANES;
 }
 
 
@@ -153,13 +204,28 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
 }
 
 
-void clip_polygon(polygon_t* polygon) {
-    clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+// ----- CLIP POLYGON AGAINST THE FRUSTUM PLANES SET IN planes -----
+// planes is the OR of the outcodes of the polygon vertices: a plane that no vertex is outside of
+// cannot cut the polygon, and neither can it cut vertices created on the other planes
+void clip_polygon(polygon_t* polygon, int planes) {
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (planes & (1 << plane)) {
+            clip_polygon_against_plane(polygon, plane);
+        }
+    }
+}
+
+
+// ----- OUTCODE OF A CAMERA SPACE VERTEX -----
+// vertex is outside of a plane when it is not strictly inside, same as in clip_polygon_against_plane
+int get_vertex_outcode(vec3_t vertex) {
+    int outcode = 0;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (vec3_dot(vec3_sub(vertex, frustum_planes[plane].point), frustum_planes[plane].normal) <= 0) {
+            outcode |= 1 << plane;
+        }
+    }
+    return outcode;
 }
 
 
@@ -180,3 +246,175 @@ void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num
     *num_triangles = polygon->num_vertices - 2;
 }
 
+
+// ----- TEST CAMERA SPACE BOUNDING SPHERE AGAINST THE SIX FRUSTUM PLANES -----
+// frustum plane normals have unit length, so the plane dot product is a signed distance;
+// inside means strictly inside like vertex outcodes, so nothing of the sphere needs clipping
+int get_sphere_frustum_visibility(vec3_t center, float radius) {
+    int visibility = FRUSTUM_INSIDE;
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= FAR_FRUSTUM_PLANE; plane++) {
+        float distance = vec3_dot(vec3_sub(center, frustum_planes[plane].point), frustum_planes[plane].normal);
+        if (distance < -radius) {
+            return FRUSTUM_OUTSIDE;
+        }
+        if (distance <= radius) {
+            visibility = FRUSTUM_INTERSECTING;
+        }
+    }
+    return visibility;
+}
+
+
+// ----- TEST THE 8 CAMERA SPACE CORNERS OF A BOUNDING BOX AGAINST THE SIX FRUSTUM PLANES -----
+// box is outside when all corners are outside one plane, inside when all corners are inside all planes
+int get_box_frustum_visibility(vec3_t corners[8]) {
+    int visibility = FRUSTUM_INSIDE;
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= FAR_FRUSTUM_PLANE; plane++) {
+        int num_inside_corners = 0;
+        for (int i = 0; i < 8; i++) {
+            if (vec3_dot(vec3_sub(corners[i], frustum_planes[plane].point), frustum_planes[plane].normal) > 0) {
+                num_inside_corners++;
+            }
+        }
+        if (num_inside_corners == 0) {
+            return FRUSTUM_OUTSIDE;
+        }
+        if (num_inside_corners < 8) {
+            visibility = FRUSTUM_INTERSECTING;
+        }
+    }
+    return visibility;
+}
+
+
+void set_clip_method(int method) {
+    clip_method = method;
+}
+
+
+int get_clip_method(void) {
+    return clip_method;
+}
+
+
+homogeneous_polygon_t homogeneous_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
+    homogeneous_polygon_t polygon = {
+        .vertices = { v0, v1, v2 },
+        .texcoords = { t0, t1, t2 },
+        .num_vertices = 3
+    };
+    return polygon;
+}
+
+
+// ----- SIGNED DISTANCE OF A CLIP SPACE VERTEX TO A FRUSTUM PLANE -----
+// after the projection matrix the frustum is the box -w <= x <= w, -w <= y <= w, 0 <= z <= w,
+// so each plane test is a comparison against w instead of a dot product with a plane normal
+//
+// Left plane   :  w + x
+// Right plane  :  w - x
+// Top plane    :  w - y
+// Bottom plane :  w + y
+// Near plane   :  z
+// Far plane    :  w - z
+//
+// guard band side planes are the same with w scaled by the guard band factor
+//
+static float homogeneous_plane_distance(vec4_t v, int plane) {
+    switch (plane) {
+        case LEFT_FRUSTUM_PLANE: return v.w + v.x;
+        case RIGHT_FRUSTUM_PLANE: return v.w - v.x;
+        case TOP_FRUSTUM_PLANE: return v.w - v.y;
+        case BOTTOM_FRUSTUM_PLANE: return v.w + v.y;
+        case NEAR_FRUSTUM_PLANE: return v.z;
+        case FAR_FRUSTUM_PLANE: return v.w - v.z;
+        case LEFT_GUARD_PLANE: return guard_band * v.w + v.x;
+        case RIGHT_GUARD_PLANE: return guard_band * v.w - v.x;
+        case TOP_GUARD_PLANE: return guard_band * v.w - v.y;
+        default: return guard_band * v.w + v.y;
+    }
+}
+
+
+void clip_homogeneous_polygon_against_plane(homogeneous_polygon_t* polygon, int plane) {
+    // polygon already clipped away by a previous plane
+    if (polygon->num_vertices == 0) {
+        return;
+    }
+
+    vec4_t inside_vertices[MAX_NUM_POLY_VERTICES];
+    tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
+    int num_inside_vertices = 0;
+
+    vec4_t* current_vertex = &polygon->vertices[0];
+    tex2_t* current_texcoord = &polygon->texcoords[0];
+    vec4_t* previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
+    tex2_t* previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
+
+    float current_distance = 0;
+    float previous_distance = homogeneous_plane_distance(*previous_vertex, plane);
+
+    while (current_vertex != &polygon->vertices[polygon->num_vertices]) {
+        current_distance = homogeneous_plane_distance(*current_vertex, plane);
+
+        // if changed from inside to outside or from outside to inside
+        if (current_distance * previous_distance < 0) {
+            float t = previous_distance / (previous_distance - current_distance);
+
+            // w is interpolated like x, y, z, clip space is still linear before the divide
+            vec4_t intersection_point = {
+                .x = float_lerp(previous_vertex->x, current_vertex->x, t),
+                .y = float_lerp(previous_vertex->y, current_vertex->y, t),
+                .z = float_lerp(previous_vertex->z, current_vertex->z, t),
+                .w = float_lerp(previous_vertex->w, current_vertex->w, t)
+            };
+            tex2_t interpolated_texcoord = {
+                .u = float_lerp(previous_texcoord->u, current_texcoord->u, t),
+                .v = float_lerp(previous_texcoord->v, current_texcoord->v, t)
+            };
+
+            inside_vertices[num_inside_vertices] = intersection_point;
+            inside_texcoords[num_inside_vertices] = interpolated_texcoord;
+            num_inside_vertices++;
+        }
+
+        // current vertex is inside plane
+        if (current_distance > 0) {
+            inside_vertices[num_inside_vertices] = *current_vertex;
+            inside_texcoords[num_inside_vertices] = *current_texcoord;
+            num_inside_vertices++;
+        }
+
+        previous_distance = current_distance;
+        previous_vertex = current_vertex;
+        previous_texcoord = current_texcoord;
+        current_vertex++;
+        current_texcoord++;
+    }
+
+    for (int i = 0; i < num_inside_vertices; i++) {
+        polygon->vertices[i] = inside_vertices[i];
+        polygon->texcoords[i] = inside_texcoords[i];
+    }
+    polygon->num_vertices = num_inside_vertices;
+}
+
+
+void clip_homogeneous_polygon(homogeneous_polygon_t* polygon, int planes) {
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (planes & (1 << plane)) {
+            clip_homogeneous_polygon_against_plane(polygon, plane);
+        }
+    }
+}
+
+
+int get_homogeneous_vertex_outcode(vec4_t vertex) {
+    int outcode = 0;
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (homogeneous_plane_distance(vertex, plane) <= 0) {
+            outcode |= 1 << plane;
+        }
+    }
+    return outcode;
+}
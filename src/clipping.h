@@ -1,6 +1,7 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdbool.h>
 #include "vector.h"
 #include "triangle.h"
 
@@ -14,6 +15,33 @@ enum {
     BOTTOM_FRUSTUM_PLANE,
     NEAR_FRUSTUM_PLANE,
     FAR_FRUSTUM_PLANE,
+    LEFT_GUARD_PLANE,
+    RIGHT_GUARD_PLANE,
+    TOP_GUARD_PLANE,
+    BOTTOM_GUARD_PLANE
+};
+
+// outcodes have bit (1 << plane) set for every frustum plane a vertex is outside of
+#define ALL_FRUSTUM_PLANES 0x3F
+#define NEAR_FAR_PLANES ((1 << NEAR_FRUSTUM_PLANE) | (1 << FAR_FRUSTUM_PLANE))
+#define ALL_GUARD_PLANES 0x3C0
+
+// side planes of the guard band are this many times wider than the frustum by default,
+// and never more than the maximum so that screen coordinates stay small for the rasterizer
+#define DEFAULT_GUARD_BAND 2.0
+#define MAX_GUARD_BAND 8.0
+
+// result of testing a bounding volume against the view frustum
+enum frustum_visibility {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTING,
+    FRUSTUM_INSIDE
+};
+
+// space in which triangles are clipped against the view frustum
+enum clip_method {
+    CLIP_CAMERA_SPACE,
+    CLIP_HOMOGENEOUS
 };
 
 typedef struct {
@@ -27,11 +55,32 @@ typedef struct {
     int num_vertices;
 } polygon_t;
 
+// polygon in homogeneous clip space, before perspective divide
+typedef struct {
+    vec4_t vertices[MAX_NUM_POLY_VERTICES];
+    tex2_t texcoords[MAX_NUM_POLY_VERTICES];
+    int num_vertices;
+} homogeneous_polygon_t;
+
 
 void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
 polygon_t polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
 void clip_polygon_against_plane(polygon_t* polygon, int plane);
-void clip_polygon(polygon_t* polygon);
+void clip_polygon(polygon_t* polygon, int planes);
+int get_vertex_outcode(vec3_t vertex);
+int get_sphere_frustum_visibility(vec3_t center, float radius);
+int get_box_frustum_visibility(vec3_t corners[8]);
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num_triangles);
 
+void set_clip_method(int method);
+int get_clip_method(void);
+void set_guard_band(float factor);
+bool is_guard_band_enabled(void);
+int get_clip_planes(int outcode);
+
+homogeneous_polygon_t homogeneous_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
+void clip_homogeneous_polygon_against_plane(homogeneous_polygon_t* polygon, int plane);
+void clip_homogeneous_polygon(homogeneous_polygon_t* polygon, int planes);
+int get_homogeneous_vertex_outcode(vec4_t vertex);
+
 #endif
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include "cpu.h"
+
+static int cpu_isa = CPU_ISA_SCALAR;
+
+static const char* cpu_isa_names[] = {
+    "scalar",
+    "sse2",
+    "avx2",
+    "avx512"
+};
+
+
+// ----- DETECT BEST INSTRUCTION SET OF CURRENT CPU -----
+static int detect_cpu_isa(void) {
+#ifdef CPU_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return CPU_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2")) return CPU_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2")) return CPU_ISA_SSE2;
+#endif
+    return CPU_ISA_SCALAR;
+}
+
+
+// ----- SELECT INSTRUCTION SET USED BY ALL KERNELS, CALLED ONCE AT STARTUP -----
+// RENDERER_ISA=scalar|sse2|avx2|avx512 forces an older instruction set for testing,
+// asking for an instruction set the cpu does not support keeps the detected one
+void init_cpu_isa(void) {
+    int detected_isa = detect_cpu_isa();
+    cpu_isa = detected_isa;
+
+    char* isa_env = SDL_getenv("RENDERER_ISA");
+    if (isa_env != NULL) {
+        for (int isa = CPU_ISA_SCALAR; isa <= CPU_ISA_AVX512; isa++) {
+            if (strcmp(isa_env, cpu_isa_names[isa]) == 0) {
+                if (isa <= detected_isa) {
+                    cpu_isa = isa;
+                } else {
+                    fprintf(stderr, "Instruction set %s is not supported, using %s.\n", isa_env, cpu_isa_names[detected_isa]);
+                }
+            }
+        }
+    }
+}
+
+
+int get_cpu_isa(void) {
+    return cpu_isa;
+}
+
+
+const char* get_cpu_isa_name(int isa) {
+    return cpu_isa_names[isa];
+}
@@ -0,0 +1,22 @@
+#ifndef CPU_H
+#define CPU_H
+
+// kernels for specific instruction sets are compiled with per-function target attributes,
+// which needs GCC or Clang on x86; every other platform only runs the scalar kernels
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CPU_X86_KERNELS
+#endif
+
+// instruction sets with dedicated kernel variants, from oldest to newest
+enum cpu_isa {
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE2,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512
+};
+
+void init_cpu_isa(void);
+int get_cpu_isa(void);
+const char* get_cpu_isa_name(int isa);
+
+#endif
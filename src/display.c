@@ -1,4 +1,11 @@
+#include <string.h>
+#include <math.h>
 #include "display.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
@@ -6,12 +13,88 @@ static SDL_Renderer* renderer = NULL;
 static uint32_t* color_buffer = NULL;
 static float* z_buffer = NULL;
 
+// visibility buffer, triangle id of every pixel written instead of its color
+static uint32_t* id_buffer = NULL;
+
+// hierarchical z-buffer, one max depth per block; a block value may be larger than the
+// depths stored in its pixels but never smaller, so it is always safe to test against
+static float* hz_buffer = NULL;
+static int hz_width = 0;
+static int hz_height = 0;
+
 static SDL_Texture* color_buffer_texture = NULL;
 static int window_width = 800;
 static int window_height = 600;
 
 static int render_method = 0;
 static int cull_method = 0;
+static bool is_depth_prepass = false;
+static bool is_visibility_buffer = false;
+static int span_subdivision = 1;
+static bool is_mipmapping = true;
+static int texture_filter = TEXTURE_FILTER_NEAREST;
+static int texture_wrap = TEXTURE_WRAP_ABS;
+static bool is_depth_test = true;
+static bool is_depth_write = true;
+
+// kernel used to fill rows of color buffer and z-buffer, selected at startup for the current cpu
+typedef void (*fill_row_kernel_t)(void* row, uint32_t value, int count);
+static fill_row_kernel_t fill_row = NULL;
+
+
+// ----- FILL count 32-BIT VALUES OF A BUFFER ROW WITH value -----
+static void fill_row_scalar(void* row, uint32_t value, int count) {
+    // memcpy keeps the same kernel valid for color values and for float depth bits
+    for (int i = 0; i < count; i++) {
+        memcpy((uint32_t*)row + i, &value, sizeof(uint32_t));
+    }
+}
+
+#ifdef CPU_X86_KERNELS
+__attribute__((target("sse2")))
+static void fill_row_sse2(void* row, uint32_t value, int count) {
+    __m128i fill = _mm_set1_epi32(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)((uint32_t*)row + i), fill);
+    }
+    fill_row_scalar((uint32_t*)row + i, value, count - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(void* row, uint32_t value, int count) {
+    __m256i fill = _mm256_set1_epi32(value);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i*)((uint32_t*)row + i), fill);
+    }
+    fill_row_scalar((uint32_t*)row + i, value, count - i);
+}
+
+__attribute__((target("avx512f")))
+static void fill_row_avx512(void* row, uint32_t value, int count) {
+    __m512i fill = _mm512_set1_epi32(value);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_si512((uint32_t*)row + i, fill);
+    }
+    // masked store for the tail, a 64-pixel tile row is exactly four stores
+    __mmask16 tail = (__mmask16)((1u << (count - i)) - 1);
+    _mm512_mask_storeu_epi32((uint32_t*)row + i, tail, fill);
+}
+#endif
+
+
+static void init_fill_row_kernel(void) {
+    fill_row = fill_row_scalar;
+#ifdef CPU_X86_KERNELS
+    switch (get_cpu_isa()) {
+        case CPU_ISA_AVX512: fill_row = fill_row_avx512; break;
+        case CPU_ISA_AVX2: fill_row = fill_row_avx2; break;
+        case CPU_ISA_SSE2: fill_row = fill_row_sse2; break;
+    }
+#endif
+}
 
 
 int get_window_width(void) {
@@ -24,6 +107,17 @@ int get_window_height(void) {
 }
 
 
+rect_t get_window_rect(void) {
+    rect_t rect = { 0, 0, window_width - 1, window_height - 1 };
+    return rect;
+}
+
+
+static bool is_inside_rect(int x, int y, rect_t rect) {
+    return x >= rect.min_x && x <= rect.max_x && y >= rect.min_y && y <= rect.max_y;
+}
+
+
 bool initialize_window(void) {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         fprintf(stderr, "Error initializing SDL.\n");
@@ -65,9 +159,16 @@ bool initialize_window(void) {
         return false;
     }
 
+    // pick buffer clear kernel for the instruction set of current cpu
+    init_fill_row_kernel();
+
     // allocate required memory in bytes to hold color buffer and z-buffer
     color_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
     z_buffer = (float*)malloc(sizeof(float) * window_width * window_height);
+    id_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
+    hz_width = (window_width + HZ_BLOCK_SIZE - 1) / HZ_BLOCK_SIZE;
+    hz_height = (window_height + HZ_BLOCK_SIZE - 1) / HZ_BLOCK_SIZE;
+    hz_buffer = (float*)malloc(sizeof(float) * hz_width * hz_height);
 
     // creating SDL texture that is used to display color buffer
     color_buffer_texture = SDL_CreateTexture(
@@ -98,11 +199,106 @@ bool is_cull_backface(void) {
 }
 
 
+void set_depth_prepass(bool enabled) {
+    is_depth_prepass = enabled;
+}
+
+
+bool is_depth_prepass_enabled(void) {
+    return is_depth_prepass;
+}
+
+
+void set_visibility_buffer(bool enabled) {
+    is_visibility_buffer = enabled;
+}
+
+
+bool is_visibility_buffer_enabled(void) {
+    return is_visibility_buffer;
+}
+
+
+// pixels between exact perspective divides of textured spans, 1 divides every pixel;
+// keys 7, 8 and 9 switch between 1, 8 and 16
+void set_span_subdivision(int pixels) {
+    span_subdivision = pixels;
+}
+
+
+int get_span_subdivision(void) {
+    return span_subdivision;
+}
+
+
+// textured triangles sample the mipmap level that matches their size on screen,
+// key L samples the full resolution texture only, key M goes back
+void set_mipmapping(bool enabled) {
+    is_mipmapping = enabled;
+}
+
+
+bool is_mipmapping_enabled(void) {
+    return is_mipmapping;
+}
+
+
+// key I switches textures to bilinear filtering, key K back to nearest texel
+void set_texture_filter(int filter) {
+    texture_filter = filter;
+}
+
+
+int get_texture_filter(void) {
+    return texture_filter;
+}
+
+
+void set_texture_wrap(int wrap) {
+    texture_wrap = wrap;
+}
+
+
+int get_texture_wrap(void) {
+    return texture_wrap;
+}
+
+
+// depth test and depth write can be turned off separately, key U turns both off, key Z back on
+void set_depth_test(bool enabled) {
+    is_depth_test = enabled;
+}
+
+
+bool is_depth_test_enabled(void) {
+    return is_depth_test;
+}
+
+
+void set_depth_write(bool enabled) {
+    is_depth_write = enabled;
+}
+
+
+bool is_depth_write_enabled(void) {
+    return is_depth_write;
+}
+
+
 
 bool should_render_textured_triangles(void) {
     return (
         render_method == RENDER_TEXTURED ||
-        render_method == RENDER_TEXTURED_WIRE
+        render_method == RENDER_TEXTURED_WIRE ||
+        render_method == RENDER_TEXTURED_LIT
+    );
+}
+
+
+// texels are shaded with the light intensity of their face, like filled triangles
+bool should_light_textures(void) {
+    return (
+        render_method == RENDER_TEXTURED_LIT
     );
 }
 
@@ -132,9 +328,12 @@ bool should_render_wire_vertex(void) {
 }
 
 
-void draw_grid(void) {
-    for (int y = 0; y < window_height; y += 10) {
-        for (int x = 0; x < window_width; x += 10) {
+void draw_grid(rect_t clip) {
+    // start at first multiple of 10 inside the clip rectangle
+    int start_x = ((clip.min_x + 9) / 10) * 10;
+    int start_y = ((clip.min_y + 9) / 10) * 10;
+    for (int y = start_y; y <= clip.max_y; y += 10) {
+        for (int x = start_x; x <= clip.max_x; x += 10) {
             color_buffer[(window_width * y) + x] = 0xFF444444;
         }
     }
@@ -149,7 +348,7 @@ void draw_pixel(int x, int y, uint32_t color) {
 }
 
 
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, rect_t clip) {
     int delta_x = (x1 - x0);
     int delta_y = (y1 - y0);
 
@@ -162,19 +361,25 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
     float current_y = y0;
 
     for (int i = 0; i <= longest_side_length; i++) {
-        draw_pixel(round(current_x), round(current_y), color);
+        int x = round(current_x);
+        int y = round(current_y);
+        if (is_inside_rect(x, y, clip)) {
+            draw_pixel(x, y, color);
+        }
         current_x += x_inc;
         current_y += y_inc;
     }
 }
 
 
-void draw_rect(int x, int y, int width, int height, uint32_t color) {
+void draw_rect(int x, int y, int width, int height, uint32_t color, rect_t clip) {
     for (int i = 0; i < width; i++) {
         for (int j = 0; j < height; j++) {
             int current_x = x + i;
             int current_y = y + j;
-            draw_pixel(current_x, current_y, color);
+            if (is_inside_rect(current_x, current_y, clip)) {
+                draw_pixel(current_x, current_y, color);
+            }
         }
     }
 }
@@ -192,17 +397,82 @@ void render_color_buffer(void) {
 }
 
 
-void clear_color_buffer(uint32_t color) {
-    for (int i = 0; i < window_width * window_height; i++) {
-        color_buffer[i] = color;
+void clear_color_buffer(uint32_t color, rect_t clip) {
+    for (int y = clip.min_y; y <= clip.max_y; y++) {
+        fill_row(&color_buffer[(window_width * y) + clip.min_x], color, clip.max_x - clip.min_x + 1);
     }
 }
 
 
-void clear_z_buffer(void) {
-    for (int i = 0; i < window_width * window_height; i++) {
-        z_buffer[i] = 1.0;
+void clear_z_buffer(rect_t clip) {
+    // fill z-buffer with the bit pattern of 1.0
+    float depth = 1.0;
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(uint32_t));
+
+    for (int y = clip.min_y; y <= clip.max_y; y++) {
+        fill_row(&z_buffer[(window_width * y) + clip.min_x], depth_bits, clip.max_x - clip.min_x + 1);
     }
+
+    // reset blocks of hierarchical z-buffer, tiles are made of whole blocks
+    int min_bx = clip.min_x / HZ_BLOCK_SIZE;
+    int max_bx = clip.max_x / HZ_BLOCK_SIZE;
+    for (int by = clip.min_y / HZ_BLOCK_SIZE; by <= clip.max_y / HZ_BLOCK_SIZE; by++) {
+        fill_row(&hz_buffer[(hz_width * by) + min_bx], depth_bits, max_bx - min_bx + 1);
+    }
+}
+
+
+void clear_id_buffer(rect_t clip) {
+    for (int y = clip.min_y; y <= clip.max_y; y++) {
+        fill_row(&id_buffer[(window_width * y) + clip.min_x], 0, clip.max_x - clip.min_x + 1);
+    }
+}
+
+
+// ----- TURN DEPTH PRE-PASS RESULT INTO AN EQUAL DEPTH TEST FOR THE SHADING PASS -----
+// span kernels only draw where depth < z; raising every stored depth to the next float
+// makes that test pass exactly for pixels at the depth that won the pre-pass, and the first
+// of them restores z, so later triangles at the same depth lose like without a pre-pass;
+// returns the number of pixels covered by any triangle
+int finish_depth_prepass(rect_t clip) {
+    int covered_pixels = 0;
+    for (int y = clip.min_y; y <= clip.max_y; y++) {
+        for (int x = clip.min_x; x <= clip.max_x; x++) {
+            float* z = &z_buffer[(window_width * y) + x];
+            if (*z < 1.0) {
+                covered_pixels++;
+                *z = nextafterf(*z, 2.0f);
+            }
+        }
+    }
+    return covered_pixels;
+}
+
+
+// direct buffer access for kernels that walk whole rows, callers stay inside the window
+uint32_t* get_color_buffer(void) {
+    return color_buffer;
+}
+
+
+float* get_z_buffer(void) {
+    return z_buffer;
+}
+
+
+uint32_t* get_id_buffer(void) {
+    return id_buffer;
+}
+
+
+float* get_hz_buffer(void) {
+    return hz_buffer;
+}
+
+
+int get_hz_width(void) {
+    return hz_width;
 }
 
 
@@ -225,6 +495,8 @@ void update_zbuffer_at(int x, int y, float value) {
 void destroy_window(void) {
     free(color_buffer);
     free(z_buffer);
+    free(id_buffer);
+    free(hz_buffer);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
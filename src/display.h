@@ -8,6 +8,14 @@
 #define FPS 30
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// screen rectangle with inclusive bounds, used to restrict drawing to a part of the buffers
+typedef struct {
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+} rect_t;
+
 // backface culling toggle
 enum cull_method {
     CULL_NONE,
@@ -21,31 +29,74 @@ enum render_method {
     RENDER_FILL_TRIANGLE,
     RENDER_FILL_TRIANGLE_WIRE,
     RENDER_TEXTURED,
-    RENDER_TEXTURED_WIRE
+    RENDER_TEXTURED_WIRE,
+    RENDER_TEXTURED_LIT
+};
+
+// texture coordinates outside 0..1
+enum texture_wrap {
+    TEXTURE_WRAP_ABS,      // mirror negative coordinates around 0, then repeat
+    TEXTURE_WRAP_REPEAT,
+    TEXTURE_WRAP_CLAMP
 };
 
+// texels sampled for a pixel
+enum texture_filter {
+    TEXTURE_FILTER_NEAREST,
+    TEXTURE_FILTER_BILINEAR    // blend of the 4 nearest texels
+};
+
+// z-buffer is also kept at a coarse level as the max depth of every block of
+// HZ_BLOCK_SIZE x HZ_BLOCK_SIZE pixels, used to reject hidden triangles and blocks at once
+#define HZ_BLOCK_SIZE 8
+
 bool initialize_window(void);
 int get_window_width(void);
 int get_window_height(void);
+rect_t get_window_rect(void);
 
 void set_render_method(int method);
 void set_cull_method(int method);
 bool is_cull_backface(void);
+void set_depth_prepass(bool enabled);
+bool is_depth_prepass_enabled(void);
+void set_visibility_buffer(bool enabled);
+bool is_visibility_buffer_enabled(void);
+void set_span_subdivision(int pixels);
+int get_span_subdivision(void);
+void set_mipmapping(bool enabled);
+bool is_mipmapping_enabled(void);
+void set_texture_filter(int filter);
+int get_texture_filter(void);
+void set_texture_wrap(int wrap);
+int get_texture_wrap(void);
+void set_depth_test(bool enabled);
+bool is_depth_test_enabled(void);
+void set_depth_write(bool enabled);
+bool is_depth_write_enabled(void);
 
 bool should_render_textured_triangles(void);
+bool should_light_textures(void);
 bool should_render_wireframe(void);
 bool should_render_filled_triangles(void);
 bool should_render_wire_vertex(void);
 
-void draw_grid(void);
+void draw_grid(rect_t clip);
 void draw_pixel(int x, int y, uint32_t color);
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
-void draw_rect(int x, int y, int width, int height, uint32_t color);
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, rect_t clip);
+void draw_rect(int x, int y, int width, int height, uint32_t color, rect_t clip);
 
 void render_color_buffer(void);
-void clear_color_buffer(uint32_t color);
-void clear_z_buffer(void);
+void clear_color_buffer(uint32_t color, rect_t clip);
+void clear_z_buffer(rect_t clip);
+void clear_id_buffer(rect_t clip);
+int finish_depth_prepass(rect_t clip);
 
+uint32_t* get_color_buffer(void);
+float* get_z_buffer(void);
+uint32_t* get_id_buffer(void);
+float* get_hz_buffer(void);
+int get_hz_width(void);
 float get_zbuffer_at(int x, int y);
 void update_zbuffer_at(int x, int y, float value);
 void destroy_window(void);
@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <stdbool.h>
 #include "display.h"
@@ -13,6 +15,11 @@
 #include "upng.h"
 #include "camera.h"
 #include "clipping.h"
+#include "tiles.h"
+#include "workers.h"
+#include "cpu.h"
+#include "bvh.h"
+#include "occlusion.h"
 
 
 // ----- GLOBAL VARIABLES FOR EXECUTION STATUS & GAME LOOP -----
@@ -20,6 +27,12 @@ bool is_running = false;
 int previous_frame_time = 0;
 float delta_time = 0.0;
 
+// guard band used when guard band clipping is turned on, RENDERER_GUARD_BAND overrides it
+float guard_band_factor = DEFAULT_GUARD_BAND;
+
+// overdraw of the depth pre-pass printed to stderr, turned on with RENDERER_REPORT_OVERDRAW
+bool is_overdraw_reported = false;
+
 // global transformation matrices
 mat4_t world_matrix;
 mat4_t proj_matrix;
@@ -27,9 +40,37 @@ mat4_t view_matrix;
 
 
 // ----- ARRAY OF TRIANGLES TO RENDER FRAME BY FRAME -----
-#define MAX_TRIANGLES_PER_MESH 100000
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
+triangle_t* triangles_to_render = NULL;
 int num_triangles_to_render = 0;
+int triangles_to_render_capacity = 0;
+
+
+// ----- GEOMETRY JOBS PROCESSED BY WORKER THREADS FRAME BY FRAME -----
+#define MESHLETS_PER_GEOMETRY_JOB 8
+
+typedef struct {
+    mesh_t* mesh;                   // mesh that owns the meshlets of this job
+    int first_meshlet;              // first meshlet index of range
+    int num_meshlets;               // number of meshlets in range
+    bool is_transform_dirty;        // transform vertices of visible meshlets before their faces
+    triangle_t* triangles;          // projected triangles produced by this job
+    int num_triangles;
+    int capacity;
+} geometry_job_t;
+
+// meshes not culled by the BVH, with the visibility of the BVH node that accepted them
+typedef struct {
+    mesh_t* mesh;
+    int visibility;
+} visible_mesh_t;
+
+visible_mesh_t* visible_meshes = NULL;
+int num_visible_meshes = 0;
+int visible_meshes_capacity = 0;
+
+geometry_job_t* geometry_jobs = NULL;
+int num_geometry_jobs = 0;
+int geometry_jobs_capacity = 0;
 
 
 // ----- INIT VARIABLES & GAME FUNCTIONS -----
@@ -38,6 +79,10 @@ void setup(void) {
     set_render_method(RENDER_TEXTURED);
     set_cull_method(CULL_BACKFACE);
 
+    // spawn one worker thread per core and split screen into tiles for parallel rendering
+    init_workers(0);
+    init_tiles();
+
     // initialize scene light direction
     init_light(vec3_new(0, 0, 1));
 
@@ -53,8 +98,61 @@ void setup(void) {
     // initialize frustum planes with a point and normal
     init_frustum_planes(fov_x,fov_y, z_near, z_far);
 
+    char* guard_band_env = SDL_getenv("RENDERER_GUARD_BAND");
+    if (guard_band_env != NULL) {
+        guard_band_factor = atof(guard_band_env);
+    }
+
+    char* report_overdraw_env = SDL_getenv("RENDERER_REPORT_OVERDRAW");
+    if (report_overdraw_env != NULL && strcmp(report_overdraw_env, "0") != 0) {
+        is_overdraw_reported = true;
+    }
+
+    // texture wrap mode: abs (default), repeat or clamp
+    char* texture_wrap_env = SDL_getenv("RENDERER_TEXTURE_WRAP");
+    if (texture_wrap_env != NULL && strcmp(texture_wrap_env, "repeat") == 0) {
+        set_texture_wrap(TEXTURE_WRAP_REPEAT);
+    } else if (texture_wrap_env != NULL && strcmp(texture_wrap_env, "clamp") == 0) {
+        set_texture_wrap(TEXTURE_WRAP_CLAMP);
+    }
+
+    // texel layout of the textures loaded below: linear (default), tiled4, tiled8 or morton
+    char* texture_layout_env = SDL_getenv("RENDERER_TEXTURE_LAYOUT");
+    if (texture_layout_env != NULL && strcmp(texture_layout_env, "tiled4") == 0) {
+        set_texture_layout(TEXTURE_LAYOUT_TILED_4);
+    } else if (texture_layout_env != NULL && strcmp(texture_layout_env, "tiled8") == 0) {
+        set_texture_layout(TEXTURE_LAYOUT_TILED_8);
+    } else if (texture_layout_env != NULL && strcmp(texture_layout_env, "morton") == 0) {
+        set_texture_layout(TEXTURE_LAYOUT_MORTON);
+    }
+
+    // texel format of the textures loaded below: RGBA32 (default) or bc, BC1/BC3 blocks 4 to 8 times smaller
+    char* texture_compression_env = SDL_getenv("RENDERER_TEXTURE_COMPRESSION");
+    if (texture_compression_env != NULL && strcmp(texture_compression_env, "bc") == 0) {
+        set_texture_compression(true);
+    }
+
     load_mesh("/Users/ten53/Developer/cpu-based-3d-graphics-renderer/assets/f22.obj", "/Users/ten53/Developer/cpu-based-3d-graphics-renderer/assets/f22.png", vec3_new(1 ,1 ,1), vec3_new(-3,0,8), vec3_new(0,0,0));
     load_mesh("/Users/ten53/Developer/cpu-based-3d-graphics-renderer/assets/efa.obj", "/Users/ten53/Developer/cpu-based-3d-graphics-renderer/assets/efa.png", vec3_new(1 ,1 ,1), vec3_new(3,0,8), vec3_new(0,0,0));
+
+    // large meshes drawn in the occlusion buffer to skip the meshes hidden behind them, as
+    // indices of the meshes above in load order: RENDERER_OCCLUDERS=0,1
+    char* occluders_env = SDL_getenv("RENDERER_OCCLUDERS");
+    if (occluders_env != NULL) {
+        char* cursor = occluders_env;
+        char* end;
+        long index = strtol(cursor, &end, 10);
+        while (end != cursor) {
+            if (index >= 0 && index < get_num_meshes()) {
+                get_mesh(index)->is_occluder = true;
+            }
+            cursor = (*end == ',') ? end + 1 : end;
+            index = strtol(cursor, &end, 10);
+        }
+    }
+
+    // hierarchy of mesh world bounds used to cull whole groups of meshes at once
+    build_bvh();
 }
 
 
@@ -103,6 +201,89 @@ void process_input(void) {
                     set_cull_method(CULL_NONE);
                     break;
                 }
+                if (event.key.keysym.sym == SDLK_v) {
+                    set_clip_method(CLIP_CAMERA_SPACE);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_h) {
+                    set_clip_method(CLIP_HOMOGENEOUS);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_g) {
+                    set_guard_band(guard_band_factor);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_n) {
+                    set_guard_band(1.0);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_p) {
+                    set_depth_prepass(true);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_o) {
+                    set_depth_prepass(false);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_b) {
+                    set_visibility_buffer(true);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_f) {
+                    set_visibility_buffer(false);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_7) {
+                    set_span_subdivision(1);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_8) {
+                    set_span_subdivision(8);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_9) {
+                    set_span_subdivision(16);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_0) {
+                    set_render_method(RENDER_TEXTURED_LIT);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_m) {
+                    set_mipmapping(true);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_l) {
+                    set_mipmapping(false);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_i) {
+                    set_texture_filter(TEXTURE_FILTER_BILINEAR);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_k) {
+                    set_texture_filter(TEXTURE_FILTER_NEAREST);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_u) {
+                    set_depth_test(false);
+                    set_depth_write(false);
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_z) {
+                    set_depth_test(true);
+                    set_depth_write(true);
+                    break;
+                }
+                // depth test and depth write on their own, for the test-only and write-only kernels
+                if (event.key.keysym.sym == SDLK_t) {
+                    set_depth_test(!is_depth_test_enabled());
+                    break;
+                }
+                if (event.key.keysym.sym == SDLK_y) {
+                    set_depth_write(!is_depth_write_enabled());
+                    break;
+                }
                 if (event.key.keysym.sym == SDLK_w) {
                     rotate_camera_pitch(+3.0 * delta_time);
                     break;
@@ -159,150 +340,385 @@ void process_input(void) {
 //                        `--> | Screen space |  <-- ready to render
 //                             +--------------+
 //
-void process_graphics_pipeline_stages(mesh_t* mesh) {
-    // create scale, rotation, and translation matrices used to multiply mesh vertices
-    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
-
-    // update camera look at target to create view matrix
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = vec3_new(0, 1, 0);
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // loop all triangle faces of mesh
-    int num_faces = array_length(mesh->faces);
-    for (int i = 0; i < num_faces; i++) {
-        face_t mesh_face = mesh->faces[i];
-
-        // current face
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh->vertices[mesh_face.a];
-        face_vertices[1] = mesh->vertices[mesh_face.b];
-        face_vertices[2] = mesh->vertices[mesh_face.c];
-
-        // transformation
-        // init array to store transformed vertices(x,y,z)
-        vec4_t transformed_vertices[3];
-
-        // loop all 3 vertices of current face and apply transformations
-        for (int j = 0; j < 3; j++) {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-            // multiply view matrix by current vector to transform scene to camera space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-            // create world matrix - combine scale, rotation, and translation matrices
-            mat4_t world_matrix = mat4_identity();
-
-            // order matters - scale first, then rotate, then translate: [T]*[R]*[S]*v
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-            // multiply world matrix by original vector
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-            // save transformed vertex in array of transformed vertices
-            transformed_vertices[j] = transformed_vertex;
+// with the guard band (key G, key N turns it off) only near and far are clipped exactly,
+// triangles crossing the screen sides are left to the rasterizer, which only walks pixels
+// inside the screen tiles; side planes are clipped only for triangles leaving the guard band
+//
+// with homogeneous clipping (key H, key V goes back) the projection is folded into the
+// vertex transform and clipping happens after it, against -w <= x, y <= w and 0 <= z <= w,
+// leaving only the perspective divide for the faces that survive
+//
+// meshes are split in meshlets of at most 64 vertices and 128 faces; the bounding sphere
+// and normal cone of every meshlet are tested first, so meshlets outside the frustum or
+// facing away from the camera are dropped before any of their vertices are transformed
+//
+// vertices of the remaining meshlets are transformed by the cached world_view_matrix into
+// mesh->transformed_vertices, then faces only gather their three transformed vertices by
+// meshlet slot; transforms are skipped for meshes whose transformation and camera did not
+// change since last frame
+//
+// one geometry job handles a range of meshlets from transform to projection on a worker
+// thread; every job writes to its own triangle list and the lists are appended to
+// triangles_to_render in job order, so output order stays deterministic
+//
+static void push_job_triangle(geometry_job_t* job, triangle_t triangle) {
+    if (job->num_triangles == job->capacity) {
+        job->capacity = (job->capacity == 0) ? 256 : job->capacity * 2;
+        job->triangles = (triangle_t*)realloc(job->triangles, sizeof(triangle_t) * job->capacity);
+    }
+    job->triangles[job->num_triangles++] = triangle;
+}
+
+
+// ----- CONVERT PROJECTED POLYGON TO SCREEN SPACE AND PUSH ITS FAN OF TRIANGLES -----
+static void push_polygon_triangles(
+    geometry_job_t* job, face_t mesh_face, vec3_t face_normal,
+    vec4_t projected_points[], tex2_t texcoords[], int num_vertices
+) {
+    // loop all projected vertices and convert them to screen space
+    for (int j = 0; j < num_vertices; j++) {
+        // flip vertically since y values of 3D mesh grow bottom->up and in screen space y values grow top->down
+        projected_points[j].y *= -1;
+
+        // scale into the view
+        projected_points[j].x *= (get_window_width() / 2.0);
+        projected_points[j].y *= (get_window_height() / 2.0);
+
+        // translate projected points to center of screen
+        projected_points[j].x += (get_window_width() / 2.0);
+        projected_points[j].y += (get_window_height() / 2.0);
+    }
+
+    // calculate shade intensity based on alignment of face normal and the inverse of the light ray
+    float light_intensity_factor = -vec3_dot(face_normal, get_light_direction());
+
+    // calculate triangle color based on angle of light
+    uint32_t triangle_color = light_apply_intensity(mesh_face.color,light_intensity_factor );
+    // lit textured triangles scale their texels by the same clamped factor
+    if (light_intensity_factor < 0) light_intensity_factor = 0;
+    if (light_intensity_factor > 1) light_intensity_factor = 1;
+
+    // break polygon into a fan of triangles after clipping, all sharing first vertex
+    for (int t = 0; t < num_vertices - 2; t++) {
+        int index0 = 0;
+        int index1 = t + 1;
+        int index2 = t + 2;
+
+        triangle_t triangle_to_render = {
+            .points = {
+                projected_points[index0],
+                projected_points[index1],
+                projected_points[index2],
+            },
+            .texcoords = {
+                texcoords[index0],
+                texcoords[index1],
+                texcoords[index2],
+            },
+            .color = triangle_color,
+            .light_intensity = light_intensity_factor,
+            .texture = job->mesh->texture
+
+        };
+
+        // save current projected triangle in the triangle list of this job
+        push_job_triangle(job, triangle_to_render);
+    }
+}
+
+
+static void process_mesh_face(geometry_job_t* job, int meshlet_index, int face_index) {
+    mesh_t* mesh = job->mesh;
+    face_t mesh_face = mesh->faces[face_index];
+
+    // slots of face vertices in the transformed vertices of its meshlet
+    int first_vertex = mesh->meshlets[meshlet_index].first_vertex;
+    int a = first_vertex + mesh->meshlet_indices[(3 * face_index) + 0];
+    int b = first_vertex + mesh->meshlet_indices[(3 * face_index) + 1];
+    int c = first_vertex + mesh->meshlet_indices[(3 * face_index) + 2];
+
+    // trivial reject: all three vertices are outside of the same frustum plane;
+    // meshlets fully inside the frustum have no outcodes and none of their faces are clipped
+    int outcodes = 0;
+    if (mesh->meshlet_visibility[meshlet_index] != FRUSTUM_INSIDE) {
+        int outcode_a = mesh->vertex_outcodes[a];
+        int outcode_b = mesh->vertex_outcodes[b];
+        int outcode_c = mesh->vertex_outcodes[c];
+        if (outcode_a & outcode_b & outcode_c & ALL_FRUSTUM_PLANES) {
+            return;
         }
+        outcodes = outcode_a | outcode_b | outcode_c;
+    }
 
-        // calculate triangle face normal
-        vec3_t face_normal = get_triangle_normal(transformed_vertices);
+    // gather vertices of current face already transformed to camera space
+    vec4_t transformed_vertices[3];
+    transformed_vertices[0] = mesh->transformed_vertices[a];
+    transformed_vertices[1] = mesh->transformed_vertices[b];
+    transformed_vertices[2] = mesh->transformed_vertices[c];
 
-        // backface culling test
-        if (is_cull_backface()) {
-            // find vector between point in triangle and camera origin
-            vec3_t origin = { 0, 0, 0 };
-            vec3_t camera_ray = vec3_sub(origin, vec3_from_vec4(transformed_vertices[0]));
+    // calculate triangle face normal
+    vec3_t face_normal = get_triangle_normal(transformed_vertices);
 
-            // calculate alignement of camera ray with face normal using dot product
-            float dot_normal_camera = vec3_dot(face_normal, camera_ray);
+    // backface culling test
+    if (is_cull_backface()) {
+        // find vector between point in triangle and camera origin
+        vec3_t origin = { 0, 0, 0 };
+        vec3_t camera_ray = vec3_sub(origin, vec3_from_vec4(transformed_vertices[0]));
 
+        // calculate alignement of camera ray with face normal using dot product
+        float dot_normal_camera = vec3_dot(face_normal, camera_ray);
 
-            // bypass projection of triangles that are looking away from camera
-            if (dot_normal_camera < 0) {
-                continue;
-            }
+
+        // bypass projection of triangles that are looking away from camera
+        if (dot_normal_camera < 0) {
+            return;
         }
+    }
+
+    // create polygon from original transformed triangle to be clipped
+    polygon_t polygon = polygon_from_triangle(
+            vec3_from_vec4(transformed_vertices[0]),
+            vec3_from_vec4(transformed_vertices[1]),
+            vec3_from_vec4(transformed_vertices[2]),
+            mesh_face.a_uv,
+            mesh_face.b_uv,
+            mesh_face.c_uv);
+
+    // returns new polygon with potential new vertices, only planes crossed by the triangle are
+    // clipped against and triangles fully inside the frustum (no outcode bits) skip clipping
+    clip_polygon(&polygon, get_clip_planes(outcodes));
+
+    // projection
+    // split clipped vertices in x, y, z streams and project all of them in one batch
+    float polygon_x[MAX_NUM_POLY_VERTICES];
+    float polygon_y[MAX_NUM_POLY_VERTICES];
+    float polygon_z[MAX_NUM_POLY_VERTICES];
+    for (int j = 0; j < polygon.num_vertices; j++) {
+        polygon_x[j] = polygon.vertices[j].x;
+        polygon_y[j] = polygon.vertices[j].y;
+        polygon_z[j] = polygon.vertices[j].z;
+    }
+
+    vec4_t projected_points[MAX_NUM_POLY_VERTICES];
+    mat4_mul_vec4_project_batch(&proj_matrix, polygon_x, polygon_y, polygon_z, projected_points, polygon.num_vertices);
+
+    push_polygon_triangles(job, mesh_face, face_normal, projected_points, polygon.texcoords, polygon.num_vertices);
+}
+
 
-        // create polygon from original transformed triangle to be clipped
-        polygon_t polygon = polygon_from_triangle(
-                vec3_from_vec4(transformed_vertices[0]),
-                vec3_from_vec4(transformed_vertices[1]),
-                vec3_from_vec4(transformed_vertices[2]),
-                mesh_face.a_uv,
-                mesh_face.b_uv,
-                mesh_face.c_uv);
+// ----- CULL, CLIP AND PROJECT ONE FACE IN HOMOGENEOUS CLIP SPACE -----
+// vertices were multiplied by projection * view * world before the faces, so clipping compares
+// coordinates against w and projection is only the perspective divide of the surviving vertices
+static void process_mesh_face_homogeneous(geometry_job_t* job, int meshlet_index, int face_index) {
+    mesh_t* mesh = job->mesh;
+    face_t mesh_face = mesh->faces[face_index];
+
+    // slots of face vertices in the transformed vertices of its meshlet
+    int first_vertex = mesh->meshlets[meshlet_index].first_vertex;
+    int a = first_vertex + mesh->meshlet_indices[(3 * face_index) + 0];
+    int b = first_vertex + mesh->meshlet_indices[(3 * face_index) + 1];
+    int c = first_vertex + mesh->meshlet_indices[(3 * face_index) + 2];
+
+    // trivial reject: all three vertices are outside of the same frustum plane;
+    // meshlets fully inside the frustum have no outcodes and none of their faces are clipped
+    int outcodes = 0;
+    if (mesh->meshlet_visibility[meshlet_index] != FRUSTUM_INSIDE) {
+        int outcode_a = mesh->vertex_outcodes[a];
+        int outcode_b = mesh->vertex_outcodes[b];
+        int outcode_c = mesh->vertex_outcodes[c];
+        if (outcode_a & outcode_b & outcode_c & ALL_FRUSTUM_PLANES) {
+            return;
+        }
+        outcodes = outcode_a | outcode_b | outcode_c;
+    }
 
-        // returns new polygon with potential new vertices
-        clip_polygon(&polygon);
+    vec4_t v0 = mesh->transformed_vertices[a];
+    vec4_t v1 = mesh->transformed_vertices[b];
+    vec4_t v2 = mesh->transformed_vertices[c];
+
+    // backface culling test
+    if (is_cull_backface()) {
+        // determinant of the (x, y, w) rows is the camera space triple product of the vertices
+        // scaled by the positive projection factors, it is positive when face looks away from camera;
+        // unlike a screen space test it stays valid for vertices behind the camera
+        float determinant =
+            v0.x * (v1.y * v2.w - v1.w * v2.y) -
+            v0.y * (v1.x * v2.w - v1.w * v2.x) +
+            v0.w * (v1.x * v2.y - v1.y * v2.x);
+        if (determinant > 0) {
+            return;
+        }
+    }
 
-        // break polygon into triangles after clipping
-        triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
-        int num_triangles_after_clipping = 0;
-        triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+    // rotate model space normal to camera space for lighting
+    vec3_t face_normal = vec3_from_vec4(mat4_mul_vec4(mesh->normal_matrix, vec4_from_vec3(mesh->face_normals[face_index])));
+    vec3_normalize(&face_normal);
+
+    homogeneous_polygon_t polygon = homogeneous_polygon_from_triangle(v0, v1, v2, mesh_face.a_uv, mesh_face.b_uv, mesh_face.c_uv);
+    clip_homogeneous_polygon(&polygon, get_clip_planes(outcodes));
+
+    // perspective divide, keeping original w for perspective correct interpolation
+    vec4_t projected_points[MAX_NUM_POLY_VERTICES];
+    for (int j = 0; j < polygon.num_vertices; j++) {
+        vec4_t v = polygon.vertices[j];
+        projected_points[j].x = v.x / v.w;
+        projected_points[j].y = v.y / v.w;
+        projected_points[j].z = v.z / v.w;
+        projected_points[j].w = v.w;
+    }
 
-        // loop all assembled triangles after clipping
-        for (int t = 0; t < num_triangles_after_clipping; t++) {
-            triangle_t triangle_after_clipping = triangles_after_clipping[t];
+    push_polygon_triangles(job, mesh_face, face_normal, projected_points, polygon.texcoords, polygon.num_vertices);
+}
 
-            // projection
-            vec4_t projected_points[3];
 
-            // loop all 3 vertices and project and convert them
-            for (int j = 0; j < 3; j++) {
+// ----- TRANSFORM THE VERTICES OF ONE MESHLET FROM MODEL SPACE TO CAMERA SPACE -----
+static void transform_meshlet_vertices(mesh_t* mesh, int meshlet_index) {
+    meshlet_t* meshlet = &mesh->meshlets[meshlet_index];
+    int first = meshlet->first_vertex;
+
+    // multiply precomposed view * world matrix by original vectors, several vertices at a time;
+    // homogeneous clipping also folds in the projection and gets clip space vertices
+    const mat4_t* matrix = (mesh->transformed_clip_method == CLIP_HOMOGENEOUS) ?
+        &mesh->world_view_projection_matrix : &mesh->world_view_matrix;
+    mat4_mul_vec4_batch(
+        matrix,
+        &mesh->vertices_x[first], &mesh->vertices_y[first], &mesh->vertices_z[first],
+        &mesh->transformed_vertices[first],
+        meshlet->num_vertices
+    );
+
+    // classify every vertex against the frustum once, faces only combine the outcodes of their vertices
+    if (mesh->meshlet_visibility[meshlet_index] == FRUSTUM_INSIDE) {
+        return;
+    }
+    if (mesh->transformed_clip_method == CLIP_HOMOGENEOUS) {
+        for (int i = first; i < first + meshlet->num_vertices; i++) {
+            mesh->vertex_outcodes[i] = get_homogeneous_vertex_outcode(mesh->transformed_vertices[i]);
+        }
+    } else {
+        for (int i = first; i < first + meshlet->num_vertices; i++) {
+            mesh->vertex_outcodes[i] = get_vertex_outcode(vec3_from_vec4(mesh->transformed_vertices[i]));
+        }
+    }
+}
 
-                // project current vertex
-                projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
 
-                // flip vertically since y values of 3D mesh grow bottom->up and in screen space y values grow top->down
-                projected_points[j].y *= -1;
+// ----- TRANSFORM, CULL, CLIP AND PROJECT A RANGE OF MESHLETS -----
+static void run_geometry_job(int job_index, void* data) {
+    geometry_job_t* job = &geometry_jobs[job_index];
+    mesh_t* mesh = job->mesh;
+    job->num_triangles = 0;
 
-                // scale into the view
-                projected_points[j].x *= (get_window_width() / 2.0);
-                projected_points[j].y *= (get_window_height() / 2.0);
+    for (int i = job->first_meshlet; i < job->first_meshlet + job->num_meshlets; i++) {
+        if (mesh->meshlet_visibility[i] == FRUSTUM_OUTSIDE) {
+            continue;
+        }
+        if (job->is_transform_dirty) {
+            transform_meshlet_vertices(mesh, i);
+        }
 
-                // translate projected points to center of screen
-                projected_points[j].x += (get_window_width() / 2.0);
-                projected_points[j].y += (get_window_height() / 2.0);
+        meshlet_t* meshlet = &mesh->meshlets[i];
+        int last_face = meshlet->first_face + meshlet->num_faces;
+        if (mesh->transformed_clip_method == CLIP_HOMOGENEOUS) {
+            for (int j = meshlet->first_face; j < last_face; j++) {
+                process_mesh_face_homogeneous(job, i, j);
             }
-
-            // calculate shade intensity based on alignment of face normal and the inverse of the light ray
-            float light_intensity_factor = -vec3_dot(face_normal, get_light_direction());
-
-            // calculate triangle color based on angle of light
-            uint32_t triangle_color = light_apply_intensity(mesh_face.color,light_intensity_factor );
-
-            triangle_t triangle_to_render = {
-                .points = {
-                    { projected_points[0].x, projected_points[0].y, projected_points[0].z, projected_points[0].w },
-                    { projected_points[1].x, projected_points[1].y, projected_points[1].z, projected_points[1].w },
-                    { projected_points[2].x, projected_points[2].y, projected_points[2].z, projected_points[2].w },
-                },
-                .texcoords = {
-                    { triangle_after_clipping.texcoords[0].u, triangle_after_clipping.texcoords[0].v },
-                    { triangle_after_clipping.texcoords[1].u, triangle_after_clipping.texcoords[1].v },
-                    { triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v },
-                },
-                .color = triangle_color,
-                .texture = mesh->texture
-
-            };
-
-            // save current projected triangle in the array of triangles to render
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH) {
-                triangles_to_render[num_triangles_to_render++] = triangle_to_render;
+        } else {
+            for (int j = meshlet->first_face; j < last_face; j++) {
+                process_mesh_face(job, i, j);
             }
         }
     }
 }
 
 
+void process_graphics_pipeline_stages(mesh_t* mesh, int bvh_visibility) {
+    // rebuild cached view * world matrices if mesh or camera moved
+    update_mesh_matrices(mesh, view_matrix, proj_matrix, get_camera_view_version());
+
+    // skip whole mesh when its bounds are outside the frustum, meshes inside a BVH node that
+    // is fully inside need no test; visibility only changes together with the view * world
+    // matrix, so outcodes of a mesh that stays inside never go stale
+    int visibility = (bvh_visibility == FRUSTUM_INSIDE) ? FRUSTUM_INSIDE : get_mesh_frustum_visibility(mesh);
+    if (visibility == FRUSTUM_OUTSIDE) {
+        return;
+    }
+    mesh->is_inside_frustum = (visibility == FRUSTUM_INSIDE);
+
+    // transformed vertices are outdated when view * world changed since they were computed
+    // (also after frames where the mesh was culled) or when clip method switched spaces;
+    // meshlet visibility also depends on the cull method
+    bool is_transform_dirty =
+        mesh->transformed_version != mesh->world_view_version ||
+        mesh->transformed_clip_method != get_clip_method() ||
+        mesh->transformed_cull_method != is_cull_backface();
+    mesh->transformed_version = mesh->world_view_version;
+    mesh->transformed_clip_method = get_clip_method();
+    mesh->transformed_cull_method = is_cull_backface();
+
+    // cull meshlets by bounding sphere and normal cone, only if view * world changed
+    int num_meshlets = array_length(mesh->meshlets);
+    if (is_transform_dirty) {
+        for (int i = 0; i < num_meshlets; i++) {
+            mesh->meshlet_visibility[i] = get_meshlet_visibility(mesh, &mesh->meshlets[i], is_cull_backface());
+        }
+    }
+
+    // queue one geometry job per range of meshlets of mesh
+    for (int first_meshlet = 0; first_meshlet < num_meshlets; first_meshlet += MESHLETS_PER_GEOMETRY_JOB) {
+        if (num_geometry_jobs == geometry_jobs_capacity) {
+            int old_capacity = geometry_jobs_capacity;
+            geometry_jobs_capacity = (old_capacity == 0) ? 64 : old_capacity * 2;
+            geometry_jobs = (geometry_job_t*)realloc(geometry_jobs, sizeof(geometry_job_t) * geometry_jobs_capacity);
+            memset(&geometry_jobs[old_capacity], 0, sizeof(geometry_job_t) * (geometry_jobs_capacity - old_capacity));
+        }
+
+        geometry_job_t* job = &geometry_jobs[num_geometry_jobs++];
+        job->mesh = mesh;
+        job->first_meshlet = first_meshlet;
+        job->num_meshlets = (num_meshlets - first_meshlet < MESHLETS_PER_GEOMETRY_JOB) ? num_meshlets - first_meshlet : MESHLETS_PER_GEOMETRY_JOB;
+        job->is_transform_dirty = is_transform_dirty;
+    }
+}
+
+
+// ----- MESHES THAT SURVIVED BVH CULLING THIS FRAME -----
+static void push_visible_mesh(mesh_t* mesh, int visibility, void* data) {
+    if (num_visible_meshes == visible_meshes_capacity) {
+        visible_meshes_capacity = (visible_meshes_capacity == 0) ? 64 : visible_meshes_capacity * 2;
+        visible_meshes = (visible_mesh_t*)realloc(visible_meshes, sizeof(visible_mesh_t) * visible_meshes_capacity);
+    }
+    visible_meshes[num_visible_meshes].mesh = mesh;
+    visible_meshes[num_visible_meshes].visibility = visibility;
+    num_visible_meshes++;
+}
+
+
+static int compare_visible_meshes(const void* a, const void* b) {
+    return ((visible_mesh_t*)a)->mesh->index - ((visible_mesh_t*)b)->mesh->index;
+}
+
+
+// ----- APPEND TRIANGLES OF ALL GEOMETRY JOBS IN JOB ORDER -----
+static void merge_geometry_jobs(void) {
+    int total_triangles = 0;
+    for (int i = 0; i < num_geometry_jobs; i++) {
+        total_triangles += geometry_jobs[i].num_triangles;
+    }
+
+    if (total_triangles > triangles_to_render_capacity) {
+        triangles_to_render_capacity = total_triangles;
+        triangles_to_render = (triangle_t*)realloc(triangles_to_render, sizeof(triangle_t) * triangles_to_render_capacity);
+    }
+
+    for (int i = 0; i < num_geometry_jobs; i++) {
+        geometry_job_t* job = &geometry_jobs[i];
+        memcpy(&triangles_to_render[num_triangles_to_render], job->triangles, sizeof(triangle_t) * job->num_triangles);
+        num_triangles_to_render += job->num_triangles;
+    }
+}
+
+
 // ----- UPDATE FRAME BY FRAME WITH FIXED TIME STEP -----
 void update(void) {
     // sleep until target frame time (millisec) is reached
@@ -318,74 +734,70 @@ void update(void) {
 
     previous_frame_time = SDL_GetTicks();
 
-    // init counter of triangles to render for current frame
+    // init counters of geometry jobs and triangles to render for current frame
+    num_geometry_jobs = 0;
     num_triangles_to_render = 0;
 
-    // loop all meshes of our scene
-    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
-        mesh_t* mesh = get_mesh(mesh_index);
-
-        // change mesh scale, rotation, and translation values per animation frame
-        // mesh.rotation.x += 0.0 * delta_time;
-        // mesh.rotation.y += 0.0 * delta_time;
-        // mesh.rotation.z += 0.0 * delta_time;
-        // mesh.translation.z = 5.0;
+    // update camera view matrix once per frame, it is only rebuilt if camera moved
+    view_matrix = get_camera_view_matrix();
+
+    // change mesh scale, rotation, and translation values per animation frame
+    // get_mesh(0)->rotation.x += 0.0 * delta_time;
+    // get_mesh(0)->rotation.y += 0.0 * delta_time;
+    // get_mesh(0)->rotation.z += 0.0 * delta_time;
+    // get_mesh(0)->translation.z = 5.0;
+
+    // refit BVH boxes of meshes that moved, then collect meshes of BVH leaves that are not
+    // outside the frustum; hidden subtrees are skipped without touching their meshes
+    update_bvh();
+    num_visible_meshes = 0;
+    cull_bvh(view_matrix, push_visible_mesh, NULL);
+
+    // queue graphics pipeline stages in load order, independent of the shape of the tree
+    qsort(visible_meshes, num_visible_meshes, sizeof(visible_mesh_t), compare_visible_meshes);
+
+    // draw visible occluders in the low resolution occlusion buffer
+    int num_occluders = 0;
+    clear_occlusion_buffer();
+    for (int i = 0; i < num_visible_meshes; i++) {
+        mesh_t* mesh = visible_meshes[i].mesh;
+        if (mesh->is_occluder) {
+            update_mesh_matrices(mesh, view_matrix, proj_matrix, get_camera_view_version());
+            draw_occluder(mesh);
+            num_occluders++;
+        }
+    }
 
-        // process graphics pipeline stages for every mesh of 3D scene
-        process_graphics_pipeline_stages(mesh);
+    // meshes whose bounds are hidden behind the occluders cost neither geometry nor raster work
+    mat4_t view_projection_matrix = mat4_mul_mat4(proj_matrix, view_matrix);
+    for (int i = 0; i < num_visible_meshes; i++) {
+        mesh_t* mesh = visible_meshes[i].mesh;
+        if (num_occluders > 0 && !mesh->is_occluder && is_mesh_occluded(mesh, view_projection_matrix)) {
+            continue;
+        }
+        process_graphics_pipeline_stages(mesh, visible_meshes[i].visibility);
     }
+
+    // transform, cull, clip and project all visible meshlets on the worker threads
+    run_parallel_jobs(num_geometry_jobs, run_geometry_job, NULL);
+    merge_geometry_jobs();
 }
 
 
 // ----- DRAW OBJECTS ON DISPLAY -----
 void render(void) {
-    // clear all arrays to prepare for next frame
-    clear_color_buffer(0xFF000000);
-    clear_z_buffer();
-
-    draw_grid();
-
-    // loop all projected triangles and render them
-    for (int i = 0; i < num_triangles_to_render; i++) {
-        triangle_t triangle = triangles_to_render[i];
-
-        // draw filled triangle
-        if (should_render_filled_triangles()) {
-            draw_filled_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, // vertex A
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, // vertex A
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, // vertex A
-                // vertex C
-                triangle.color
-            );
-        }
-
-        // draw textured triangle
-        if (should_render_textured_triangles()) {
-            draw_textured_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v, // vertex A
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v, // vertex B
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v, // vertex C
-                triangle.texture
-            );
-        }
-
-        // draw triangle wireframe
-        if (should_render_wireframe()) {
-            draw_triangle(
-                triangle.points[0].x, triangle.points[0].y, // vertex A
-                triangle.points[1].x, triangle.points[1].y, // vertex B
-                triangle.points[2].x, triangle.points[2].y, // vertex C
-                0xFFFFFFFF
-            );
-        }
-
-        // draw triangle vertex points
-        if (should_render_wire_vertex()) {
-            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFF0000); // vertex A
-            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFF0000); // vertex B
-            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFF0000); // vertex C
-        }
+    // sort projected triangles into screen tiles
+    bin_triangles(triangles_to_render, num_triangles_to_render);
+
+    // clear and rasterize all tiles in parallel on the worker threads, forward shading or
+    // with the visibility buffer (key B, key F goes back to forward shading)
+    render_tiles();
+
+    // with the depth pre-pass (key P, key O turns it off) report overdraw once per second,
+    // values close to 1 mean the pre-pass costs more than the shading it saves
+    static int frame_count = 0;
+    if (is_overdraw_reported && is_depth_prepass_enabled() && ++frame_count % FPS == 0) {
+        fprintf(stderr, "Overdraw factor %.2f\n", get_overdraw_factor());
     }
 
     // draw color buffer to SDL window
@@ -395,6 +807,16 @@ void render(void) {
 
 // ----- FREE ALL DYNAMICALLY ALLOCATED MEMORY -----
 void free_resources(void) {
+    for (int i = 0; i < geometry_jobs_capacity; i++) {
+        free(geometry_jobs[i].triangles);
+    }
+    free(geometry_jobs);
+    free(visible_meshes);
+    free_bvh();
+    free_occlusion_buffer();
+    free(triangles_to_render);
+    free_tiles();
+    destroy_workers();
     free_meshes();
     destroy_window();
 }
@@ -402,6 +824,10 @@ void free_resources(void) {
 
 // ----- ENTRY POINT -----
 int main(void) {
+    // choose SSE2/AVX2/AVX-512 kernels before anything that uses them is set up
+    init_cpu_isa();
+    init_triangle_kernels();
+
     is_running = initialize_window();
 
     setup();
@@ -1,5 +1,11 @@
 #include <math.h>
+#include <stdbool.h>
 #include "matrix.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 mat4_t mat4_identity(void) {
     // | 1 0 0 0 |
@@ -131,6 +137,165 @@ vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
 }
 
 
+// ----- TRANSFORM count POSITIONS (x[i], y[i], z[i], 1) BY MATRIX m -----
+// SSE2 kernel handles 4, AVX2 kernel 8 and AVX-512 kernel 16 vertices per instruction,
+// results are transposed back into vec4_t; operations happen in the same order as
+// mat4_mul_vec4 so every kernel gives bit-identical results
+//
+//   x: | x0 x1 x2 x3 |          result: | x0' y0' z0' w0' |
+//   y: | y0 y1 y2 y3 |   --->           | x1' y1' z1' w1' |
+//   z: | z0 z1 z2 z3 |                  | x2' y2' z2' w2' |
+//                                       | x3' y3' z3' w3' |
+//
+// every kernel returns the number of vertices it transformed, the rest is done by the scalar loop
+#ifdef CPU_X86_KERNELS
+__attribute__((target("sse2")))
+static void store_transposed_sse2(vec4_t* result, __m128 rx, __m128 ry, __m128 rz, __m128 rw) {
+    _MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+    _mm_storeu_ps(&result[0].x, rx);
+    _mm_storeu_ps(&result[1].x, ry);
+    _mm_storeu_ps(&result[2].x, rz);
+    _mm_storeu_ps(&result[3].x, rw);
+}
+
+__attribute__((target("sse2")))
+static int mat4_mul_vec4_batch_sse2(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count, bool project) {
+    __m128 m00 = _mm_set1_ps(m->m[0][0]), m01 = _mm_set1_ps(m->m[0][1]), m02 = _mm_set1_ps(m->m[0][2]), m03 = _mm_set1_ps(m->m[0][3]);
+    __m128 m10 = _mm_set1_ps(m->m[1][0]), m11 = _mm_set1_ps(m->m[1][1]), m12 = _mm_set1_ps(m->m[1][2]), m13 = _mm_set1_ps(m->m[1][3]);
+    __m128 m20 = _mm_set1_ps(m->m[2][0]), m21 = _mm_set1_ps(m->m[2][1]), m22 = _mm_set1_ps(m->m[2][2]), m23 = _mm_set1_ps(m->m[2][3]);
+    __m128 m30 = _mm_set1_ps(m->m[3][0]), m31 = _mm_set1_ps(m->m[3][1]), m32 = _mm_set1_ps(m->m[3][2]), m33 = _mm_set1_ps(m->m[3][3]);
+    __m128 zero = _mm_setzero_ps();
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(&x[i]);
+        __m128 vy = _mm_loadu_ps(&y[i]);
+        __m128 vz = _mm_loadu_ps(&z[i]);
+
+        __m128 rx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx), _mm_mul_ps(m01, vy)), _mm_mul_ps(m02, vz)), m03);
+        __m128 ry = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx), _mm_mul_ps(m11, vy)), _mm_mul_ps(m12, vz)), m13);
+        __m128 rz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, vx), _mm_mul_ps(m21, vy)), _mm_mul_ps(m22, vz)), m23);
+        __m128 rw = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m30, vx), _mm_mul_ps(m31, vy)), _mm_mul_ps(m32, vz)), m33);
+
+        if (project) {
+            // perspective divide only on lanes where w is not zero
+            __m128 has_w = _mm_cmpneq_ps(rw, zero);
+            rx = _mm_or_ps(_mm_and_ps(has_w, _mm_div_ps(rx, rw)), _mm_andnot_ps(has_w, rx));
+            ry = _mm_or_ps(_mm_and_ps(has_w, _mm_div_ps(ry, rw)), _mm_andnot_ps(has_w, ry));
+            rz = _mm_or_ps(_mm_and_ps(has_w, _mm_div_ps(rz, rw)), _mm_andnot_ps(has_w, rz));
+        }
+
+        store_transposed_sse2(&result[i], rx, ry, rz, rw);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int mat4_mul_vec4_batch_avx2(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count, bool project) {
+    __m256 m00 = _mm256_set1_ps(m->m[0][0]), m01 = _mm256_set1_ps(m->m[0][1]), m02 = _mm256_set1_ps(m->m[0][2]), m03 = _mm256_set1_ps(m->m[0][3]);
+    __m256 m10 = _mm256_set1_ps(m->m[1][0]), m11 = _mm256_set1_ps(m->m[1][1]), m12 = _mm256_set1_ps(m->m[1][2]), m13 = _mm256_set1_ps(m->m[1][3]);
+    __m256 m20 = _mm256_set1_ps(m->m[2][0]), m21 = _mm256_set1_ps(m->m[2][1]), m22 = _mm256_set1_ps(m->m[2][2]), m23 = _mm256_set1_ps(m->m[2][3]);
+    __m256 m30 = _mm256_set1_ps(m->m[3][0]), m31 = _mm256_set1_ps(m->m[3][1]), m32 = _mm256_set1_ps(m->m[3][2]), m33 = _mm256_set1_ps(m->m[3][3]);
+    __m256 zero = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 vx = _mm256_loadu_ps(&x[i]);
+        __m256 vy = _mm256_loadu_ps(&y[i]);
+        __m256 vz = _mm256_loadu_ps(&z[i]);
+
+        __m256 rx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, vx), _mm256_mul_ps(m01, vy)), _mm256_mul_ps(m02, vz)), m03);
+        __m256 ry = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m10, vx), _mm256_mul_ps(m11, vy)), _mm256_mul_ps(m12, vz)), m13);
+        __m256 rz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m20, vx), _mm256_mul_ps(m21, vy)), _mm256_mul_ps(m22, vz)), m23);
+        __m256 rw = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m30, vx), _mm256_mul_ps(m31, vy)), _mm256_mul_ps(m32, vz)), m33);
+
+        if (project) {
+            // perspective divide only on lanes where w is not zero
+            __m256 has_w = _mm256_cmp_ps(rw, zero, _CMP_NEQ_UQ);
+            rx = _mm256_blendv_ps(rx, _mm256_div_ps(rx, rw), has_w);
+            ry = _mm256_blendv_ps(ry, _mm256_div_ps(ry, rw), has_w);
+            rz = _mm256_blendv_ps(rz, _mm256_div_ps(rz, rw), has_w);
+        }
+
+        // transpose lower and upper 4 vertices separately
+        store_transposed_sse2(&result[i + 0], _mm256_castps256_ps128(rx), _mm256_castps256_ps128(ry), _mm256_castps256_ps128(rz), _mm256_castps256_ps128(rw));
+        store_transposed_sse2(&result[i + 4], _mm256_extractf128_ps(rx, 1), _mm256_extractf128_ps(ry, 1), _mm256_extractf128_ps(rz, 1), _mm256_extractf128_ps(rw, 1));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static int mat4_mul_vec4_batch_avx512(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count, bool project) {
+    __m512 m00 = _mm512_set1_ps(m->m[0][0]), m01 = _mm512_set1_ps(m->m[0][1]), m02 = _mm512_set1_ps(m->m[0][2]), m03 = _mm512_set1_ps(m->m[0][3]);
+    __m512 m10 = _mm512_set1_ps(m->m[1][0]), m11 = _mm512_set1_ps(m->m[1][1]), m12 = _mm512_set1_ps(m->m[1][2]), m13 = _mm512_set1_ps(m->m[1][3]);
+    __m512 m20 = _mm512_set1_ps(m->m[2][0]), m21 = _mm512_set1_ps(m->m[2][1]), m22 = _mm512_set1_ps(m->m[2][2]), m23 = _mm512_set1_ps(m->m[2][3]);
+    __m512 m30 = _mm512_set1_ps(m->m[3][0]), m31 = _mm512_set1_ps(m->m[3][1]), m32 = _mm512_set1_ps(m->m[3][2]), m33 = _mm512_set1_ps(m->m[3][3]);
+    __m512 zero = _mm512_setzero_ps();
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 vx = _mm512_loadu_ps(&x[i]);
+        __m512 vy = _mm512_loadu_ps(&y[i]);
+        __m512 vz = _mm512_loadu_ps(&z[i]);
+
+        __m512 rx = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m00, vx), _mm512_mul_ps(m01, vy)), _mm512_mul_ps(m02, vz)), m03);
+        __m512 ry = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m10, vx), _mm512_mul_ps(m11, vy)), _mm512_mul_ps(m12, vz)), m13);
+        __m512 rz = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m20, vx), _mm512_mul_ps(m21, vy)), _mm512_mul_ps(m22, vz)), m23);
+        __m512 rw = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m30, vx), _mm512_mul_ps(m31, vy)), _mm512_mul_ps(m32, vz)), m33);
+
+        if (project) {
+            // perspective divide only on lanes where w is not zero
+            __mmask16 has_w = _mm512_cmp_ps_mask(rw, zero, _CMP_NEQ_UQ);
+            rx = _mm512_mask_div_ps(rx, has_w, rx, rw);
+            ry = _mm512_mask_div_ps(ry, has_w, ry, rw);
+            rz = _mm512_mask_div_ps(rz, has_w, rz, rw);
+        }
+
+        // transpose each group of 4 vertices separately
+        store_transposed_sse2(&result[i + 0], _mm512_extractf32x4_ps(rx, 0), _mm512_extractf32x4_ps(ry, 0), _mm512_extractf32x4_ps(rz, 0), _mm512_extractf32x4_ps(rw, 0));
+        store_transposed_sse2(&result[i + 4], _mm512_extractf32x4_ps(rx, 1), _mm512_extractf32x4_ps(ry, 1), _mm512_extractf32x4_ps(rz, 1), _mm512_extractf32x4_ps(rw, 1));
+        store_transposed_sse2(&result[i + 8], _mm512_extractf32x4_ps(rx, 2), _mm512_extractf32x4_ps(ry, 2), _mm512_extractf32x4_ps(rz, 2), _mm512_extractf32x4_ps(rw, 2));
+        store_transposed_sse2(&result[i + 12], _mm512_extractf32x4_ps(rx, 3), _mm512_extractf32x4_ps(ry, 3), _mm512_extractf32x4_ps(rz, 3), _mm512_extractf32x4_ps(rw, 3));
+    }
+    return i;
+}
+#endif
+
+static int mat4_mul_vec4_batch_simd(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count, bool project) {
+    int i = 0;
+#ifdef CPU_X86_KERNELS
+    // wider kernels leave their tail to the narrower ones
+    switch (get_cpu_isa()) {
+        case CPU_ISA_AVX512:
+            i += mat4_mul_vec4_batch_avx512(m, x, y, z, result, count, project);
+            // fall through
+        case CPU_ISA_AVX2:
+            i += mat4_mul_vec4_batch_avx2(m, x + i, y + i, z + i, result + i, count - i, project);
+            // fall through
+        case CPU_ISA_SSE2:
+            i += mat4_mul_vec4_batch_sse2(m, x + i, y + i, z + i, result + i, count - i, project);
+    }
+#endif
+    return i;
+}
+
+void mat4_mul_vec4_batch(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count) {
+    int i = mat4_mul_vec4_batch_simd(m, x, y, z, result, count, false);
+    for (; i < count; i++) {
+        vec4_t v = { x[i], y[i], z[i], 1.0 };
+        result[i] = mat4_mul_vec4(*m, v);
+    }
+}
+
+void mat4_mul_vec4_project_batch(const mat4_t* mat_proj, const float* x, const float* y, const float* z, vec4_t* result, int count) {
+    int i = mat4_mul_vec4_batch_simd(mat_proj, x, y, z, result, count, true);
+    for (; i < count; i++) {
+        vec4_t v = { x[i], y[i], z[i], 1.0 };
+        result[i] = mat4_mul_vec4_project(*mat_proj, v);
+    }
+}
+
+
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
     // Compute the forward (z), right (x), and up (y) vectors
     vec3_t z = vec3_sub(target, eye);
@@ -152,3 +317,22 @@ mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
     return view_matrix;
 }
 
+
+// ----- MATRIX THAT TRANSFORMS NORMALS THE SAME WAY m TRANSFORMS POSITIONS -----
+// cofactor matrix of the upper 3x3 of m, which is the inverse transpose scaled by the
+// determinant; normals stay perpendicular to surfaces even with non-uniform scale and
+// only their length changes, so they still have to be normalized after the multiply
+mat4_t mat4_make_normal(mat4_t m) {
+    mat4_t n = {{{ 0 }}};
+    n.m[0][0] = m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1];
+    n.m[0][1] = m.m[1][2] * m.m[2][0] - m.m[1][0] * m.m[2][2];
+    n.m[0][2] = m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0];
+    n.m[1][0] = m.m[0][2] * m.m[2][1] - m.m[0][1] * m.m[2][2];
+    n.m[1][1] = m.m[0][0] * m.m[2][2] - m.m[0][2] * m.m[2][0];
+    n.m[1][2] = m.m[0][1] * m.m[2][0] - m.m[0][0] * m.m[2][1];
+    n.m[2][0] = m.m[0][1] * m.m[1][2] - m.m[0][2] * m.m[1][1];
+    n.m[2][1] = m.m[0][2] * m.m[1][0] - m.m[0][0] * m.m[1][2];
+    n.m[2][2] = m.m[0][0] * m.m[1][1] - m.m[0][1] * m.m[1][0];
+    n.m[3][3] = 1.0;
+    return n;
+}
@@ -23,7 +23,12 @@ vec4_t mat4_mul_vec4(mat4_t m, vec4_t v);
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
 
+// batch versions for streams of positions stored as separate x[], y[], z[] arrays with w = 1
+void mat4_mul_vec4_batch(const mat4_t* m, const float* x, const float* y, const float* z, vec4_t* result, int count);
+void mat4_mul_vec4_project_batch(const mat4_t* mat_proj, const float* x, const float* y, const float* z, vec4_t* result, int count);
+
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
+mat4_t mat4_make_normal(mat4_t m);
 
 #endif
 
@@ -1,24 +1,171 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "mesh.h"
 #include "array.h"
+#include "clipping.h"
 
 
-#define MAX_NUM_MESHES 10
-static mesh_t meshes[MAX_NUM_MESHES];
-static int mesh_count = 0;
+// dynamic array of all meshes of the scene, no limit on how many are loaded
+static mesh_t** meshes = NULL;
+
+
+// ----- BOUNDING SPHERE AND NORMAL CONE OF A MESHLET -----
+static void compute_meshlet_bounds(mesh_t* mesh, meshlet_t* meshlet) {
+    // sphere around center of the box of meshlet vertices, radius reaches the farthest vertex
+    vec3_t min = vec3_new(mesh->vertices_x[meshlet->first_vertex], mesh->vertices_y[meshlet->first_vertex], mesh->vertices_z[meshlet->first_vertex]);
+    vec3_t max = min;
+    for (int i = meshlet->first_vertex; i < meshlet->first_vertex + meshlet->num_vertices; i++) {
+        if (mesh->vertices_x[i] < min.x) min.x = mesh->vertices_x[i];
+        if (mesh->vertices_y[i] < min.y) min.y = mesh->vertices_y[i];
+        if (mesh->vertices_z[i] < min.z) min.z = mesh->vertices_z[i];
+        if (mesh->vertices_x[i] > max.x) max.x = mesh->vertices_x[i];
+        if (mesh->vertices_y[i] > max.y) max.y = mesh->vertices_y[i];
+        if (mesh->vertices_z[i] > max.z) max.z = mesh->vertices_z[i];
+    }
+    meshlet->center = vec3_mul(vec3_add(min, max), 0.5);
+    meshlet->radius = 0;
+    for (int i = meshlet->first_vertex; i < meshlet->first_vertex + meshlet->num_vertices; i++) {
+        vec3_t vertex = vec3_new(mesh->vertices_x[i], mesh->vertices_y[i], mesh->vertices_z[i]);
+        float distance = vec3_length(vec3_sub(vertex, meshlet->center));
+        if (distance > meshlet->radius) {
+            meshlet->radius = distance;
+        }
+    }
+
+    // cone axis is the average face normal, half angle reaches the normal farthest from it
+    vec3_t axis = vec3_new(0, 0, 0);
+    for (int i = meshlet->first_face; i < meshlet->first_face + meshlet->num_faces; i++) {
+        axis = vec3_add(axis, mesh->face_normals[i]);
+    }
+    vec3_normalize(&axis);
+    meshlet->cone_axis = axis;
+    meshlet->cone_cos_angle = 1;
+    for (int i = meshlet->first_face; i < meshlet->first_face + meshlet->num_faces; i++) {
+        float cos_angle = vec3_dot(axis, mesh->face_normals[i]);
+        // degenerate faces have no normal and must never be culled as a group
+        if (isnan(cos_angle)) {
+            meshlet->cone_cos_angle = 0;
+            break;
+        }
+        if (cos_angle < meshlet->cone_cos_angle) {
+            meshlet->cone_cos_angle = cos_angle;
+        }
+    }
+}
+
+
+// ----- SPLIT MESH FACES IN MESHLETS OF AT MOST 64 VERTICES AND 128 FACES -----
+// faces are taken in file order and a new meshlet starts when the next face does not fit,
+// so meshlets are contiguous face ranges and faces are still processed in their original
+// order; vertices used by several meshlets are copied into every one of them
+static void build_meshlets(mesh_t* mesh) {
+    int num_vertices = array_length(mesh->vertices);
+    int num_faces = array_length(mesh->faces);
+
+    // slot of every mesh vertex inside the meshlet being built, -1 if not part of it
+    int* vertex_slots = (int*)malloc(sizeof(int) * num_vertices);
+    for (int i = 0; i < num_vertices; i++) {
+        vertex_slots[i] = -1;
+    }
+    int* meshlet_vertices = NULL;
+
+    mesh->meshlet_indices = (uint8_t*)malloc(sizeof(uint8_t) * 3 * num_faces);
+    meshlet_t meshlet = { 0 };
+
+    for (int i = 0; i < num_faces; i++) {
+        int face_vertices[3] = { mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c };
+
+        int num_new_vertices = 0;
+        for (int j = 0; j < 3; j++) {
+            bool is_repeated = (j > 0 && face_vertices[j] == face_vertices[0]) || (j > 1 && face_vertices[j] == face_vertices[1]);
+            if (vertex_slots[face_vertices[j]] == -1 && !is_repeated) {
+                num_new_vertices++;
+            }
+        }
+
+        // close current meshlet and start an empty one when face does not fit
+        if (meshlet.num_faces == MESHLET_MAX_FACES || meshlet.num_vertices + num_new_vertices > MESHLET_MAX_VERTICES) {
+            for (int j = meshlet.first_vertex; j < meshlet.first_vertex + meshlet.num_vertices; j++) {
+                vertex_slots[meshlet_vertices[j]] = -1;
+            }
+            array_push(mesh->meshlets, meshlet);
+            meshlet.first_face = i;
+            meshlet.num_faces = 0;
+            meshlet.first_vertex += meshlet.num_vertices;
+            meshlet.num_vertices = 0;
+        }
+
+        for (int j = 0; j < 3; j++) {
+            if (vertex_slots[face_vertices[j]] == -1) {
+                vertex_slots[face_vertices[j]] = meshlet.num_vertices++;
+                array_push(meshlet_vertices, face_vertices[j]);
+            }
+            mesh->meshlet_indices[(3 * i) + j] = vertex_slots[face_vertices[j]];
+        }
+        meshlet.num_faces++;
+    }
+    if (meshlet.num_faces > 0) {
+        array_push(mesh->meshlets, meshlet);
+    }
+
+    // split meshlet vertex positions in separate x, y, z streams used by batch transforms
+    int num_meshlet_vertices = array_length(meshlet_vertices);
+    mesh->vertices_x = (float*)malloc(sizeof(float) * num_meshlet_vertices);
+    mesh->vertices_y = (float*)malloc(sizeof(float) * num_meshlet_vertices);
+    mesh->vertices_z = (float*)malloc(sizeof(float) * num_meshlet_vertices);
+    for (int i = 0; i < num_meshlet_vertices; i++) {
+        mesh->vertices_x[i] = mesh->vertices[meshlet_vertices[i]].x;
+        mesh->vertices_y[i] = mesh->vertices[meshlet_vertices[i]].y;
+        mesh->vertices_z[i] = mesh->vertices[meshlet_vertices[i]].z;
+    }
+
+    // allocate buffers that hold every meshlet vertex after transformation, filled frame by frame
+    mesh->transformed_vertices = (vec4_t*)malloc(sizeof(vec4_t) * num_meshlet_vertices);
+    mesh->vertex_outcodes = (uint16_t*)malloc(sizeof(uint16_t) * num_meshlet_vertices);
+    mesh->meshlet_visibility = (uint8_t*)malloc(sizeof(uint8_t) * array_length(mesh->meshlets));
+
+    for (int i = 0; i < array_length(mesh->meshlets); i++) {
+        compute_meshlet_bounds(mesh, &mesh->meshlets[i]);
+    }
+
+    array_free(meshlet_vertices);
+    free(vertex_slots);
+}
 
 
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation) {
-    load_mesh_obj_data(&meshes[mesh_count], obj_filename);
-    load_mesh_png_data(&meshes[mesh_count], png_filename);
+    // meshes live on the heap so pointers held by jobs and the BVH stay valid while the scene grows
+    mesh_t* mesh = (mesh_t*)calloc(1, sizeof(mesh_t));
+    load_mesh_obj_data(mesh, obj_filename);
+    load_mesh_png_data(mesh, png_filename);
+
+    // face normals never change in model space, clip space pipeline only rotates them
+    int num_faces = array_length(mesh->faces);
+    mesh->face_normals = (vec3_t*)malloc(sizeof(vec3_t) * num_faces);
+    for (int i = 0; i < num_faces; i++) {
+        face_t face = mesh->faces[i];
+        vec4_t face_vertices[3] = {
+            vec4_from_vec3(mesh->vertices[face.a]),
+            vec4_from_vec3(mesh->vertices[face.b]),
+            vec4_from_vec3(mesh->vertices[face.c])
+        };
+        mesh->face_normals[i] = get_triangle_normal(face_vertices);
+    }
+
+    // split faces in meshlets, which also lays out the vertex streams used by batch transforms
+    build_meshlets(mesh);
 
-    meshes[mesh_count].scale = scale;
-    meshes[mesh_count].translation = translation;
-    meshes[mesh_count].rotation = rotation;
+    mesh->scale = scale;
+    mesh->translation = translation;
+    mesh->rotation = rotation;
 
-    mesh_count++;
+    // nothing transformed yet, first frame the mesh is visible runs its vertex jobs
+    mesh->transformed_version = -1;
+
+    mesh->index = array_length(meshes);
+    array_push(meshes, mesh);
 }
 
 
@@ -74,36 +221,232 @@ void load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
     // clean up
     array_free(texcoords);
     fclose(file);
+
+    // axis aligned bounding box of all vertices
+    int num_vertices = array_length(mesh->vertices);
+    mesh->bounds_min = vec3_new(0, 0, 0);
+    mesh->bounds_max = vec3_new(0, 0, 0);
+    for (int i = 0; i < num_vertices; i++) {
+        vec3_t v = mesh->vertices[i];
+        if (i == 0 || v.x < mesh->bounds_min.x) mesh->bounds_min.x = v.x;
+        if (i == 0 || v.y < mesh->bounds_min.y) mesh->bounds_min.y = v.y;
+        if (i == 0 || v.z < mesh->bounds_min.z) mesh->bounds_min.z = v.z;
+        if (i == 0 || v.x > mesh->bounds_max.x) mesh->bounds_max.x = v.x;
+        if (i == 0 || v.y > mesh->bounds_max.y) mesh->bounds_max.y = v.y;
+        if (i == 0 || v.z > mesh->bounds_max.z) mesh->bounds_max.z = v.z;
+    }
+
+    // bounding sphere around center of the box, radius reaches the farthest vertex
+    mesh->bounding_sphere_center = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5);
+    mesh->bounding_sphere_radius = 0;
+    for (int i = 0; i < num_vertices; i++) {
+        float distance = vec3_length(vec3_sub(mesh->vertices[i], mesh->bounding_sphere_center));
+        if (distance > mesh->bounding_sphere_radius) {
+            mesh->bounding_sphere_radius = distance;
+        }
+    }
 }
 
 
+// images that are missing or in formats load_png_texture() does not take (grey, palette)
+// leave the mesh with a white texture, so textured modes draw it like a plain lit surface
 void load_mesh_png_data(mesh_t* mesh, char* png_filename) {
-    upng_t* png_image = upng_new_from_file(png_filename);
-    if (png_image != NULL) {
-        upng_decode(png_image);
-        if (upng_get_error(png_image) == UPNG_EOK) {
-            mesh->texture = png_image;
+    mesh->texture = load_png_texture(png_filename);
+    if (mesh->texture == NULL) {
+        mesh->texture = create_solid_texture(0xFFFFFFFF);
+    }
+}
+
+
+static bool vec3_equals(vec3_t a, vec3_t b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+
+// ----- REBUILD CACHED WORLD MATRIX AND WORLD BOUNDS IF MESH TRANSFORMATION CHANGED -----
+// returns true when the mesh moved, so its world bounds in the BVH have to be refitted
+bool update_mesh_world_matrix(mesh_t* mesh) {
+    mesh_transform_cache_t* cache = &mesh->transform_cache;
+
+    bool is_world_dirty = !cache->is_world_valid ||
+        !vec3_equals(cache->scale, mesh->scale) ||
+        !vec3_equals(cache->rotation, mesh->rotation) ||
+        !vec3_equals(cache->translation, mesh->translation);
+    if (!is_world_dirty) {
+        return false;
+    }
+
+    // create scale, rotation, and translation matrices used to multiply mesh vertices
+    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
+
+    // order matters - scale first, then rotate, then translate: [T]*[R]*[S]*v
+    mat4_t world_matrix = mat4_identity();
+    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+    mesh->world_matrix = world_matrix;
+
+    // world space box around the 8 transformed corners of the model space box
+    for (int i = 0; i < 8; i++) {
+        vec3_t corner = {
+            .x = (i & 1) ? mesh->bounds_max.x : mesh->bounds_min.x,
+            .y = (i & 2) ? mesh->bounds_max.y : mesh->bounds_min.y,
+            .z = (i & 4) ? mesh->bounds_max.z : mesh->bounds_min.z
+        };
+        vec3_t world_corner = vec3_from_vec4(mat4_mul_vec4(world_matrix, vec4_from_vec3(corner)));
+        if (i == 0) {
+            mesh->world_bounds_min = world_corner;
+            mesh->world_bounds_max = world_corner;
         }
+        if (world_corner.x < mesh->world_bounds_min.x) mesh->world_bounds_min.x = world_corner.x;
+        if (world_corner.y < mesh->world_bounds_min.y) mesh->world_bounds_min.y = world_corner.y;
+        if (world_corner.z < mesh->world_bounds_min.z) mesh->world_bounds_min.z = world_corner.z;
+        if (world_corner.x > mesh->world_bounds_max.x) mesh->world_bounds_max.x = world_corner.x;
+        if (world_corner.y > mesh->world_bounds_max.y) mesh->world_bounds_max.y = world_corner.y;
+        if (world_corner.z > mesh->world_bounds_max.z) mesh->world_bounds_max.z = world_corner.z;
+    }
+
+    cache->scale = mesh->scale;
+    cache->rotation = mesh->rotation;
+    cache->translation = mesh->translation;
+    cache->is_world_valid = true;
+    cache->is_world_view_valid = false;
+    return true;
+}
+
+
+// ----- REBUILD CACHED VIEW * WORLD MATRICES IF MESH OR CAMERA CHANGED -----
+// only called for meshes that survive BVH culling, so hidden meshes cost nothing when the
+// camera moves; world_view_version is bumped whenever transformed vertices become outdated;
+// projection matrix is fixed for the whole run, so it is not part of the cached state
+void update_mesh_matrices(mesh_t* mesh, mat4_t view_matrix, mat4_t projection_matrix, int view_version) {
+    mesh_transform_cache_t* cache = &mesh->transform_cache;
+    update_mesh_world_matrix(mesh);
+
+    if (!cache->is_world_view_valid || cache->view_version != view_version) {
+        // vertices go to world space first and then to camera space: [V]*[W]*v
+        mesh->world_view_matrix = mat4_mul_mat4(view_matrix, mesh->world_matrix);
+        mesh->world_view_projection_matrix = mat4_mul_mat4(projection_matrix, mesh->world_view_matrix);
+        mesh->normal_matrix = mat4_make_normal(mesh->world_view_matrix);
+        mesh->world_view_version++;
+        cache->view_version = view_version;
+        cache->is_world_view_valid = true;
+    }
+}
+
+
+// ----- TEST MESH BOUNDS AGAINST THE VIEW FRUSTUM USING ITS CACHED VIEW * WORLD MATRIX -----
+// bounding sphere first since it only needs one transformed point, box corners only when
+// the sphere intersects a plane; returns one of FRUSTUM_OUTSIDE, INTERSECTING or INSIDE
+int get_mesh_frustum_visibility(mesh_t* mesh) {
+    // radius grows with the largest scale factor, view and rotation matrices keep lengths
+    float max_scale = fabs(mesh->scale.x);
+    if (fabs(mesh->scale.y) > max_scale) max_scale = fabs(mesh->scale.y);
+    if (fabs(mesh->scale.z) > max_scale) max_scale = fabs(mesh->scale.z);
+
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(mesh->world_view_matrix, vec4_from_vec3(mesh->bounding_sphere_center)));
+    int visibility = get_sphere_frustum_visibility(center, mesh->bounding_sphere_radius * max_scale);
+    if (visibility != FRUSTUM_INTERSECTING) {
+        return visibility;
+    }
+
+    vec3_t corners[8];
+    for (int i = 0; i < 8; i++) {
+        vec3_t corner = {
+            .x = (i & 1) ? mesh->bounds_max.x : mesh->bounds_min.x,
+            .y = (i & 2) ? mesh->bounds_max.y : mesh->bounds_min.y,
+            .z = (i & 4) ? mesh->bounds_max.z : mesh->bounds_min.z
+        };
+        corners[i] = vec3_from_vec4(mat4_mul_vec4(mesh->world_view_matrix, vec4_from_vec3(corner)));
+    }
+    return get_box_frustum_visibility(corners);
+}
+
+
+// ----- FRUSTUM AND NORMAL CONE TEST OF A MESHLET BEFORE ANY OF ITS VERTICES ARE TRANSFORMED -----
+// returns FRUSTUM_OUTSIDE when the bounding sphere is outside the frustum, or when every face
+// of the meshlet looks away from the camera for all points of the sphere
+//
+//    normal cone                   a face is backfacing when its normal n and the ray from the
+//      \  |  /                     camera to the face point the same way; all faces are when
+//       \ | /  half angle a        angle(axis, ray to center) + a + b < 90 deg, where b is the
+//      ( sphere )                  angle the sphere covers as seen from the camera
+//          |  b
+//          |
+//       camera
+//
+int get_meshlet_visibility(mesh_t* mesh, meshlet_t* meshlet, bool is_cull_backface) {
+    float max_scale = fabs(mesh->scale.x);
+    if (fabs(mesh->scale.y) > max_scale) max_scale = fabs(mesh->scale.y);
+    if (fabs(mesh->scale.z) > max_scale) max_scale = fabs(mesh->scale.z);
+
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(mesh->world_view_matrix, vec4_from_vec3(meshlet->center)));
+    float radius = meshlet->radius * max_scale;
+
+    int visibility = mesh->is_inside_frustum ? FRUSTUM_INSIDE : get_sphere_frustum_visibility(center, radius);
+    if (visibility == FRUSTUM_OUTSIDE || !is_cull_backface || meshlet->cone_cos_angle <= 0) {
+        return visibility;
+    }
+
+    // non-uniform scale changes angles between normals, cone is only valid for uniform scale
+    bool is_uniform_scale = fabs(mesh->scale.x) == fabs(mesh->scale.y) && fabs(mesh->scale.y) == fabs(mesh->scale.z);
+    float distance = vec3_length(center);
+    if (!is_uniform_scale || distance <= radius) {
+        return visibility;
+    }
+
+    vec3_t axis = vec3_from_vec4(mat4_mul_vec4(mesh->normal_matrix, vec4_from_vec3(meshlet->cone_axis)));
+    vec3_normalize(&axis);
+
+    float cos_a = meshlet->cone_cos_angle;
+    float sin_a = sqrt(1 - cos_a * cos_a);
+    float sin_b = radius / distance;
+    float cos_b = sqrt(1 - sin_b * sin_b);
+    float cos_a_b = cos_a * cos_b - sin_a * sin_b;
+    float sin_a_b = sin_a * cos_b + cos_a * sin_b;
+
+    // small margin keeps rounding from culling faces that are exactly edge on
+    if (cos_a_b > 0 && vec3_dot(axis, vec3_div(center, distance)) > sin_a_b + 0.001) {
+        return FRUSTUM_OUTSIDE;
     }
+    return visibility;
 }
 
 
 int get_num_meshes(void) {
-    return mesh_count;
+    return array_length(meshes);
 }
 
 
 mesh_t* get_mesh(int index) {
-    return &meshes[index];
+    return meshes[index];
 }
 
 
 void free_meshes(void) {
-    for (int i = 0; i < mesh_count; i++) {
-        upng_free(meshes[i].texture);
-        array_free(meshes[i].faces);
-        array_free(meshes[i].vertices);
+    for (int i = 0; i < array_length(meshes); i++) {
+        free_texture(meshes[i]->texture);
+        array_free(meshes[i]->faces);
+        free(meshes[i]->face_normals);
+        array_free(meshes[i]->vertices);
+        free(meshes[i]->vertices_x);
+        free(meshes[i]->vertices_y);
+        free(meshes[i]->vertices_z);
+        free(meshes[i]->transformed_vertices);
+        free(meshes[i]->vertex_outcodes);
+        array_free(meshes[i]->meshlets);
+        free(meshes[i]->meshlet_indices);
+        free(meshes[i]->meshlet_visibility);
+        free(meshes[i]);
     }
+    array_free(meshes);
+    meshes = NULL;
 }
 
 
@@ -1,22 +1,82 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
 #include "vector.h"
+#include "matrix.h"
 #include "triangle.h"
-#include "upng.h"
+#include "texture.h"
 
+// transformation used to build the cached mesh matrices, compared every frame to detect changes
 typedef struct {
+    vec3_t rotation;
+    vec3_t scale;
+    vec3_t translation;
+    bool is_world_valid;
+    int view_version;
+    bool is_world_view_valid;
+} mesh_transform_cache_t;
+
+// meshes are split at load into meshlets (clusters) of neighbouring faces that are culled,
+// transformed and processed together; meshlets never exceed these limits
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_FACES 128
+
+typedef struct {
+    int first_face;         // faces of a meshlet are a contiguous range of mesh faces
+    int num_faces;
+    int first_vertex;       // first slot of meshlet in vertex streams and transformed vertices
+    int num_vertices;
+    vec3_t center;          // model space bounding sphere
+    float radius;
+    vec3_t cone_axis;       // model space normal cone, every face normal is within the cone
+    float cone_cos_angle;   // cosine of cone half angle, 0 or less if cone is too wide to cull with
+} meshlet_t;
+
+typedef struct {
+    int index;              // position of mesh in the scene, in load order
     vec3_t* vertices;       // mesh dynamic array of vertices
+    meshlet_t* meshlets;    // mesh dynamic array of meshlets, built at load
+    uint8_t* meshlet_indices; // 3 vertex slots per face, relative to first_vertex of its meshlet
+    uint8_t* meshlet_visibility; // FRUSTUM_OUTSIDE for culled meshlets, else frustum visibility
+    float* vertices_x;      // meshlet vertex positions split in x[], y[], z[] streams for batch transforms,
+    float* vertices_y;      // every meshlet has its own copy of the vertices it shares with others
+    float* vertices_z;
+    vec4_t* transformed_vertices; // meshlet vertices in camera space or clip space, updated every frame
+    int transformed_clip_method;  // clip method that transformed_vertices were computed for
+    int transformed_cull_method;  // cull method that meshlet_visibility was computed for
+    int transformed_version;      // world_view_version that transformed_vertices were computed for
+    uint16_t* vertex_outcodes;    // frustum and guard band planes every transformed vertex is outside of
     face_t* faces;          // mesh dynamic array of faces
-    upng_t* texture;        // mesh PNG texture pointer
+    vec3_t* face_normals;   // model space normal of every face, computed at load
+    vec3_t bounds_min;      // model space axis aligned bounding box, computed at load
+    vec3_t bounds_max;
+    vec3_t bounding_sphere_center; // model space bounding sphere, computed at load
+    float bounding_sphere_radius;
+    texture_t* texture;     // mesh texture, decoded from PNG at load
     vec3_t rotation;        // mesh rotation (x, y, z) values -  Euler angles
     vec3_t scale;           // mesh scaling x, y, z
     vec3_t translation;     // mesh translation x, y, z
+    mat4_t world_matrix;    // cached world matrix [T]*[R]*[S]
+    vec3_t world_bounds_min; // world space axis aligned bounding box, updated with world matrix
+    vec3_t world_bounds_max;
+    int bvh_node;           // BVH leaf that holds this mesh
+    mat4_t world_view_matrix; // cached view * world matrix
+    mat4_t world_view_projection_matrix; // cached projection * view * world matrix
+    mat4_t normal_matrix;   // cached matrix that takes model space normals to camera space
+    int world_view_version; // bumped every time world_view_matrix is rebuilt
+    mesh_transform_cache_t transform_cache; // transformation of cached matrices
+    bool is_inside_frustum; // whole mesh is inside the frustum this frame, faces need no clipping
+    bool is_occluder;       // large mesh drawn in the occlusion buffer to hide the meshes behind it
 } mesh_t;
 
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
 void load_mesh_obj_data(mesh_t* mesh, char* obj_filename);
 void load_mesh_png_data(mesh_t* mesh, char* png_filename);
+int get_mesh_frustum_visibility(mesh_t* mesh);
+int get_meshlet_visibility(mesh_t* mesh, meshlet_t* meshlet, bool is_cull_backface);
+bool update_mesh_world_matrix(mesh_t* mesh);
+void update_mesh_matrices(mesh_t* mesh, mat4_t view_matrix, mat4_t projection_matrix, int view_version);
 
 int get_num_meshes(void);
 mesh_t* get_mesh(int index);
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+#include "occlusion.h"
+#include "array.h"
+
+// ----- SOFTWARE OCCLUSION CULLING -----
+// designated occluder meshes are drawn into a small depth-only buffer before the geometry
+// stage; the screen rectangle of the world bounds of every other mesh is then compared to it,
+// and meshes whose nearest point is behind all occluder depth in that rectangle are skipped
+//
+//   occlusion buffer (256 x 128)
+//   +-------------------------+
+//   |     +--------+          |
+//   |     |occluder|  [mesh]  |  <-- visible, rectangle is not fully covered
+//   |     | [mesh] |          |  <-- hidden if nearest point is farther than
+//   |     +--------+          |      the occluder depth under its rectangle
+//   +-------------------------+
+//
+// every value of the buffer is the farthest camera depth (w) of an occluder surface that
+// covers the whole buffer pixel, so a buffer pixel only hides what is behind all of it
+
+static float occlusion_buffer[OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT];
+
+// clip space vertices of the occluder being drawn
+static vec4_t* occluder_vertices = NULL;
+static int occluder_vertices_capacity = 0;
+
+
+void clear_occlusion_buffer(void) {
+    for (int i = 0; i < OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT; i++) {
+        occlusion_buffer[i] = FLT_MAX;
+    }
+}
+
+
+// ----- MAP CLIP SPACE POSITION TO CONTINUOUS OCCLUSION BUFFER COORDINATES -----
+static vec2_t get_occlusion_buffer_position(vec4_t v) {
+    vec2_t position = {
+        .x = (v.x / v.w + 1.0) * 0.5 * OCCLUSION_BUFFER_WIDTH,
+        .y = (1.0 - v.y / v.w) * 0.5 * OCCLUSION_BUFFER_HEIGHT
+    };
+    return position;
+}
+
+
+// ----- DRAW ONE OCCLUDER TRIANGLE WITH ITS FARTHEST DEPTH -----
+// only buffer pixels whose whole square is inside the triangle are written; the edge
+// function is tested at the corner of the square that is farthest inside each edge
+static void draw_occluder_triangle(vec4_t v0, vec4_t v1, vec4_t v2) {
+    // triangles touching the near plane are skipped, leaving out an occluder is always safe
+    if (v0.w <= 0 || v1.w <= 0 || v2.w <= 0) {
+        return;
+    }
+
+    vec2_t p[3] = {
+        get_occlusion_buffer_position(v0),
+        get_occlusion_buffer_position(v1),
+        get_occlusion_buffer_position(v2)
+    };
+
+    // make every triangle wind the same way, so inside is negative for all three edges
+    float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+    if (area == 0) {
+        return;
+    }
+    if (area > 0) {
+        vec2_t swap = p[1];
+        p[1] = p[2];
+        p[2] = swap;
+    }
+
+    float depth = v0.w > v1.w ? (v0.w > v2.w ? v0.w : v2.w) : (v1.w > v2.w ? v1.w : v2.w);
+
+    float min_x = fmin(p[0].x, fmin(p[1].x, p[2].x));
+    float min_y = fmin(p[0].y, fmin(p[1].y, p[2].y));
+    float max_x = fmax(p[0].x, fmax(p[1].x, p[2].x));
+    float max_y = fmax(p[0].y, fmax(p[1].y, p[2].y));
+    int x_start = min_x < 0 ? 0 : (int)floor(min_x);
+    int y_start = min_y < 0 ? 0 : (int)floor(min_y);
+    int x_end = max_x > OCCLUSION_BUFFER_WIDTH ? OCCLUSION_BUFFER_WIDTH : (int)ceil(max_x);
+    int y_end = max_y > OCCLUSION_BUFFER_HEIGHT ? OCCLUSION_BUFFER_HEIGHT : (int)ceil(max_y);
+
+    // edge i goes from p[i] to p[i + 1], inside is where a * x + b * y + c < 0 for all edges
+    float edge_a[3], edge_b[3], edge_c[3];
+    for (int i = 0; i < 3; i++) {
+        vec2_t from = p[i];
+        vec2_t to = p[(i + 1) % 3];
+        edge_a[i] = -(to.y - from.y);
+        edge_b[i] = to.x - from.x;
+        edge_c[i] = -(edge_a[i] * from.x + edge_b[i] * from.y);
+
+        // offset to the square corner with the largest edge value
+        edge_c[i] += (edge_a[i] > 0 ? edge_a[i] : 0) + (edge_b[i] > 0 ? edge_b[i] : 0);
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        for (int x = x_start; x < x_end; x++) {
+            bool is_covered = true;
+            for (int i = 0; i < 3; i++) {
+                if (edge_a[i] * x + edge_b[i] * y + edge_c[i] >= 0) {
+                    is_covered = false;
+                }
+            }
+            float* value = &occlusion_buffer[(OCCLUSION_BUFFER_WIDTH * y) + x];
+            if (is_covered && depth < *value) {
+                *value = depth;
+            }
+        }
+    }
+}
+
+
+// ----- DRAW ALL FACES OF AN OCCLUDER MESH INTO THE OCCLUSION BUFFER -----
+// mesh matrices must be up to date for the current camera
+void draw_occluder(mesh_t* mesh) {
+    int num_vertices = 0;
+    for (int i = 0; i < array_length(mesh->meshlets); i++) {
+        num_vertices += mesh->meshlets[i].num_vertices;
+    }
+    if (num_vertices > occluder_vertices_capacity) {
+        occluder_vertices_capacity = num_vertices;
+        occluder_vertices = (vec4_t*)realloc(occluder_vertices, sizeof(vec4_t) * occluder_vertices_capacity);
+    }
+
+    mat4_mul_vec4_batch(
+        &mesh->world_view_projection_matrix,
+        mesh->vertices_x, mesh->vertices_y, mesh->vertices_z,
+        occluder_vertices, num_vertices
+    );
+
+    for (int i = 0; i < array_length(mesh->meshlets); i++) {
+        meshlet_t* meshlet = &mesh->meshlets[i];
+        for (int j = meshlet->first_face; j < meshlet->first_face + meshlet->num_faces; j++) {
+            draw_occluder_triangle(
+                occluder_vertices[meshlet->first_vertex + mesh->meshlet_indices[(3 * j) + 0]],
+                occluder_vertices[meshlet->first_vertex + mesh->meshlet_indices[(3 * j) + 1]],
+                occluder_vertices[meshlet->first_vertex + mesh->meshlet_indices[(3 * j) + 2]]
+            );
+        }
+    }
+}
+
+
+// ----- TEST WORLD BOUNDS OF A MESH AGAINST THE OCCLUSION BUFFER -----
+bool is_mesh_occluded(mesh_t* mesh, mat4_t view_projection_matrix) {
+    vec3_t min = mesh->world_bounds_min;
+    vec3_t max = mesh->world_bounds_max;
+
+    float nearest_depth = FLT_MAX;
+    float min_x = FLT_MAX, min_y = FLT_MAX;
+    float max_x = -FLT_MAX, max_y = -FLT_MAX;
+    for (int i = 0; i < 8; i++) {
+        vec4_t corner = {
+            .x = (i & 1) ? max.x : min.x,
+            .y = (i & 2) ? max.y : min.y,
+            .z = (i & 4) ? max.z : min.z,
+            .w = 1
+        };
+        vec4_t v = mat4_mul_vec4(view_projection_matrix, corner);
+
+        // bounds reaching behind the camera cover the whole view and are never hidden
+        if (v.w <= 0) {
+            return false;
+        }
+        vec2_t p = get_occlusion_buffer_position(v);
+        if (v.w < nearest_depth) nearest_depth = v.w;
+        if (p.x < min_x) min_x = p.x;
+        if (p.y < min_y) min_y = p.y;
+        if (p.x > max_x) max_x = p.x;
+        if (p.y > max_y) max_y = p.y;
+    }
+
+    // every buffer pixel touched by the screen rectangle of the bounds must hide it
+    int x_start = min_x < 0 ? 0 : (int)floor(min_x);
+    int y_start = min_y < 0 ? 0 : (int)floor(min_y);
+    int x_end = max_x > OCCLUSION_BUFFER_WIDTH ? OCCLUSION_BUFFER_WIDTH : (int)ceil(max_x);
+    int y_end = max_y > OCCLUSION_BUFFER_HEIGHT ? OCCLUSION_BUFFER_HEIGHT : (int)ceil(max_y);
+    if (x_start >= x_end || y_start >= y_end) {
+        return false;
+    }
+    for (int y = y_start; y < y_end; y++) {
+        for (int x = x_start; x < x_end; x++) {
+            if (occlusion_buffer[(OCCLUSION_BUFFER_WIDTH * y) + x] >= nearest_depth) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+void free_occlusion_buffer(void) {
+    free(occluder_vertices);
+    occluder_vertices = NULL;
+    occluder_vertices_capacity = 0;
+}
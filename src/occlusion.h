@@ -0,0 +1,17 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <stdbool.h>
+#include "matrix.h"
+#include "mesh.h"
+
+// low resolution depth-only buffer that occluder meshes are drawn into every frame
+#define OCCLUSION_BUFFER_WIDTH 256
+#define OCCLUSION_BUFFER_HEIGHT 128
+
+void clear_occlusion_buffer(void);
+void draw_occluder(mesh_t* mesh);
+bool is_mesh_occluded(mesh_t* mesh, mat4_t view_projection_matrix);
+void free_occlusion_buffer(void);
+
+#endif
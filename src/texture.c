@@ -1,7 +1,407 @@
+#include <stdlib.h>
 #include "texture.h"
+#include "upng.h"
+
+// layout and compression of textures loaded from now on
+static int texture_layout = TEXTURE_LAYOUT_LINEAR;
+static bool is_texture_compression = false;
+
 
 tex2_t tex2_clone(tex2_t* t) {
     tex2_t result = { t->u, t->v };
     return result;
 }
 
+
+void set_texture_layout(int layout) {
+    texture_layout = layout;
+}
+
+
+void set_texture_compression(bool enabled) {
+    is_texture_compression = enabled;
+}
+
+
+static int get_power_of_two_shift(int size) {
+    int shift = 0;
+    while ((1 << shift) < size) {
+        shift++;
+    }
+    return shift;
+}
+
+
+// spread the bits of a coordinate to the even bits of the result: abcd -> 0a0b0c0d
+static int spread_bits(int value) {
+    int result = 0;
+    for (int bit = 0; value >> bit != 0; bit++) {
+        result |= ((value >> bit) & 1) << (2 * bit);
+    }
+    return result;
+}
+
+
+// ----- FILL THE OFFSET TABLES THAT ADDRESS TEXELS IN THE LAYOUT OF A TEXTURE -----
+// tiles hold tile_size x tile_size texels row after row, and tiles follow each other row
+// after row; Z-order interleaves x and y inside squares as large as the shorter side, and
+// the squares follow each other along the longer side; textures smaller than a tile are
+// kept linear
+static void set_texture_offsets(texture_t* texture) {
+    int tile_shift = (texture->layout == TEXTURE_LAYOUT_TILED_4) ? 2 : 3;
+    int tile_size = 1 << tile_shift;
+    if (texture->layout != TEXTURE_LAYOUT_LINEAR && texture->layout != TEXTURE_LAYOUT_MORTON &&
+        (texture->width < tile_size || texture->height < tile_size)) {
+        texture->layout = TEXTURE_LAYOUT_LINEAR;
+    }
+
+    int square_size = (texture->width < texture->height) ? texture->width : texture->height;
+    int square_shift = get_power_of_two_shift(square_size);
+
+    for (int x = 0; x < texture->width; x++) {
+        switch (texture->layout) {
+            case TEXTURE_LAYOUT_TILED_4:
+            case TEXTURE_LAYOUT_TILED_8:
+                texture->x_offsets[x] = ((x >> tile_shift) << (2 * tile_shift)) + (x & (tile_size - 1));
+                break;
+            case TEXTURE_LAYOUT_MORTON:
+                texture->x_offsets[x] = ((x >> square_shift) << (2 * square_shift)) + spread_bits(x & (square_size - 1));
+                break;
+            default:
+                texture->x_offsets[x] = x;
+        }
+    }
+    for (int y = 0; y < texture->height; y++) {
+        switch (texture->layout) {
+            case TEXTURE_LAYOUT_TILED_4:
+            case TEXTURE_LAYOUT_TILED_8:
+                texture->y_offsets[y] = (y >> tile_shift) * (texture->width << tile_shift) + ((y & (tile_size - 1)) << tile_shift);
+                break;
+            case TEXTURE_LAYOUT_MORTON:
+                texture->y_offsets[y] = (y >> square_shift) * (texture->width << square_shift) + (spread_bits(y & (square_size - 1)) << 1);
+                break;
+            default:
+                texture->y_offsets[y] = y * texture->pitch;
+        }
+    }
+}
+
+
+// ----- ALLOCATE TEXELS AND OFFSET TABLES OF A TEXTURE IN CURRENT LAYOUT -----
+static void init_texture(texture_t* texture, int width, int height) {
+    texture->width = width;
+    texture->height = height;
+    texture->width_mask = width - 1;
+    texture->height_mask = height - 1;
+    texture->pitch = width;
+    texture->format = TEXTURE_FORMAT_RGBA32;
+    texture->layout = texture_layout;
+    texture->texels = (uint32_t*)malloc(sizeof(uint32_t) * texture->pitch * height);
+    texture->blocks = NULL;
+    texture->block_shift = 0;
+    texture->x_offsets = (int*)malloc(sizeof(int) * width);
+    texture->y_offsets = (int*)malloc(sizeof(int) * height);
+    texture->mipmaps = NULL;
+    texture->num_mipmaps = 0;
+    set_texture_offsets(texture);
+}
+
+
+// ----- BUILD THE MIPMAP CHAIN OF A TEXTURE DOWN TO A SINGLE TEXEL -----
+// every texel of a level is the average of the 2x2 texels it covers in the level above
+// (2x1 or 1x2 once one side is down to a single texel)
+//
+//   level 0          level 1      level 2
+//   +--+--+--+--+    +--+--+      +--+
+//   |a |b |  |  |    |  |  |      |  |
+//   +--+--+--+--+ -> +--+--+  ->  +--+
+//   |c |d |  |  |    |  |  |
+//   +--+--+--+--+    +--+--+   (a + b + c + d) / 4 per channel
+//
+static void build_mipmaps(texture_t* texture) {
+    int num_mipmaps = 0;
+    while ((texture->width >> num_mipmaps) > 1 || (texture->height >> num_mipmaps) > 1) {
+        num_mipmaps++;
+    }
+    texture->mipmaps = (texture_t*)malloc(sizeof(texture_t) * num_mipmaps);
+    texture->num_mipmaps = num_mipmaps;
+
+    for (int level = 1; level <= num_mipmaps; level++) {
+        const texture_t* source = get_texture_level(texture, level - 1);
+        texture_t* mipmap = &texture->mipmaps[level - 1];
+        init_texture(mipmap, (source->width > 1) ? source->width / 2 : 1, (source->height > 1) ? source->height / 2 : 1);
+
+        int step_x = (source->width > 1) ? 1 : 0;
+        int step_y = (source->height > 1) ? 1 : 0;
+        for (int y = 0; y < mipmap->height; y++) {
+            for (int x = 0; x < mipmap->width; x++) {
+                uint32_t quad[4] = {
+                    get_texel(source, (x << step_x), (y << step_y)),
+                    get_texel(source, (x << step_x) + step_x, (y << step_y)),
+                    get_texel(source, (x << step_x), (y << step_y) + step_y),
+                    get_texel(source, (x << step_x) + step_x, (y << step_y) + step_y)
+                };
+                uint32_t average = 0;
+                for (int channel = 0; channel < 32; channel += 8) {
+                    uint32_t sum = 2;  // rounds the average to nearest
+                    for (int i = 0; i < 4; i++) {
+                        sum += (quad[i] >> channel) & 0xFF;
+                    }
+                    average |= (sum / 4) << channel;
+                }
+                mipmap->texels[mipmap->x_offsets[x] + mipmap->y_offsets[y]] = average;
+            }
+        }
+    }
+}
+
+
+static uint32_t pack_rgb565(int r, int g, int b) {
+    return (uint32_t)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+
+static int get_color_distance(uint32_t a, uint32_t b) {
+    int distance = 0;
+    for (int channel = 0; channel < 24; channel += 8) {
+        int difference = (int)((a >> channel) & 0xFF) - (int)((b >> channel) & 0xFF);
+        distance += difference * difference;
+    }
+    return distance;
+}
+
+
+// ----- ENCODE THE COLORS OF 4x4 TEXELS AS A COLOR BLOCK -----
+// the endpoints are two opposite corners of the box that bounds the colors, inset by 1/16
+// of its size; of the 4 diagonals of the box the one with the smallest error is kept,
+// which follows colors that fade one channel in while another fades out
+static uint64_t encode_color_block(const uint32_t texels[16]) {
+    int min[3] = { 255, 255, 255 };
+    int max[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 3; c++) {
+            int value = (texels[i] >> (8 * c)) & 0xFF;
+            min[c] = (value < min[c]) ? value : min[c];
+            max[c] = (value > max[c]) ? value : max[c];
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        int inset = (max[c] - min[c]) >> 4;
+        min[c] += inset;
+        max[c] -= inset;
+    }
+
+    uint64_t best_block = 0;
+    int best_error = -1;
+    for (int diagonal = 0; diagonal < 4; diagonal++) {
+        // bit 0 flips green, bit 1 flips blue
+        int g0 = (diagonal & 1) ? min[1] : max[1];
+        int g1 = (diagonal & 1) ? max[1] : min[1];
+        int b0 = (diagonal & 2) ? min[2] : max[2];
+        int b1 = (diagonal & 2) ? max[2] : min[2];
+        uint32_t color0 = pack_rgb565(max[0], g0, b0);
+        uint32_t color1 = pack_rgb565(min[0], g1, b1);
+        if (color0 < color1) {
+            uint32_t swap = color0;
+            color0 = color1;
+            color1 = swap;
+        }
+
+        // with equal endpoints every texel keeps index 0
+        uint64_t block = (uint64_t)color0 | ((uint64_t)color1 << 16);
+        uint32_t palette[4];
+        int num_colors = (color0 > color1) ? 4 : 1;
+        for (int index = 0; index < num_colors; index++) {
+            palette[index] = decode_color_block(block | ((uint64_t)index << 32), 0);
+        }
+
+        int error = 0;
+        for (int i = 0; i < 16; i++) {
+            int best_index = 0;
+            int best_distance = get_color_distance(texels[i], palette[0]);
+            for (int index = 1; index < num_colors; index++) {
+                int distance = get_color_distance(texels[i], palette[index]);
+                if (distance < best_distance) {
+                    best_distance = distance;
+                    best_index = index;
+                }
+            }
+            block |= (uint64_t)best_index << (32 + 2 * i);
+            error += best_distance;
+        }
+        if (best_error < 0 || error < best_error) {
+            best_error = error;
+            best_block = block;
+        }
+    }
+    return best_block;
+}
+
+
+// ----- ENCODE THE ALPHAS OF 4x4 TEXELS AS AN ALPHA BLOCK -----
+// the endpoints are the largest and smallest alpha, so the 8 alpha palette spans them
+static uint64_t encode_alpha_block(const uint32_t texels[16]) {
+    uint32_t min = 255;
+    uint32_t max = 0;
+    for (int i = 0; i < 16; i++) {
+        uint32_t alpha = texels[i] >> 24;
+        min = (alpha < min) ? alpha : min;
+        max = (alpha > max) ? alpha : max;
+    }
+
+    uint64_t block = (uint64_t)max | ((uint64_t)min << 8);
+    if (max == min) {
+        return block;
+    }
+    uint32_t palette[8];
+    for (int code = 0; code < 8; code++) {
+        palette[code] = decode_alpha_block(block | ((uint64_t)code << 16), 0);
+    }
+    for (int i = 0; i < 16; i++) {
+        int alpha = (int)(texels[i] >> 24);
+        int best_code = 0;
+        for (int code = 1; code < 8; code++) {
+            if (abs(alpha - (int)palette[code]) < abs(alpha - (int)palette[best_code])) {
+                best_code = code;
+            }
+        }
+        block |= (uint64_t)best_code << (16 + 3 * i);
+    }
+    return block;
+}
+
+
+// ----- REPLACE THE TEXELS OF A TEXTURE WITH BC1 OR BC3 BLOCKS -----
+// blocks follow each other row after row, so a block is itself a 4x4 tile; levels smaller
+// than a block repeat their last row and column to fill it
+//
+//   RGBA32 512x512: 1 MB    BC3: 256 KB    BC1: 128 KB
+//
+static void compress_texture(texture_t* texture, int format) {
+    int blocks_x = (texture->width + 3) / 4;
+    int blocks_y = (texture->height + 3) / 4;
+    int block_shift = (format == TEXTURE_FORMAT_BC3) ? 1 : 0;
+    uint64_t* blocks = (uint64_t*)malloc(sizeof(uint64_t) * ((blocks_x * blocks_y) << block_shift));
+
+    for (int block_y = 0; block_y < blocks_y; block_y++) {
+        for (int block_x = 0; block_x < blocks_x; block_x++) {
+            uint32_t texels[16];
+            for (int i = 0; i < 16; i++) {
+                int x = (block_x << 2) + (i & 3);
+                int y = (block_y << 2) + (i >> 2);
+                texels[i] = get_texel(texture, (x < texture->width) ? x : texture->width - 1, (y < texture->height) ? y : texture->height - 1);
+            }
+            uint64_t* block = &blocks[((block_y * blocks_x) + block_x) << block_shift];
+            if (format == TEXTURE_FORMAT_BC3) {
+                block[0] = encode_alpha_block(texels);
+                block[1] = encode_color_block(texels);
+            } else {
+                block[0] = encode_color_block(texels);
+            }
+        }
+    }
+
+    for (int x = 0; x < texture->width; x++) {
+        texture->x_offsets[x] = x >> 2;
+    }
+    for (int y = 0; y < texture->height; y++) {
+        texture->y_offsets[y] = (y >> 2) * blocks_x;
+    }
+    free(texture->texels);
+    texture->texels = NULL;
+    texture->blocks = blocks;
+    texture->block_shift = block_shift;
+    texture->format = format;
+    texture->layout = TEXTURE_LAYOUT_TILED_4;
+}
+
+
+// ----- DECODE A PNG FILE INTO A TEXTURE, NULL IF IT CAN NOT BE READ -----
+// RGB and RGBA images are stored as RGBA32 in the current texture layout, with their mipmap
+// chain; images whose sides are not powers of two are resampled (nearest texel) up to the
+// next power of two, texture coordinates are normalized so they still map to the same part
+// of the image; with compression enabled every level is then stored as BC1 blocks, or BC3
+// blocks when the image has transparent texels
+// ----- TEXTURE FROM AN RGB8 OR RGBA8 IMAGE, IN THE LAYOUT AND FORMAT SET FOR LOADING -----
+// images that are not a power of two wide and high are resampled to the next one up
+texture_t* create_image_texture(const unsigned char* image, int image_width, int image_height, int components) {
+    texture_t* texture = (texture_t*)malloc(sizeof(texture_t));
+    int width_shift = get_power_of_two_shift(image_width);
+    int height_shift = get_power_of_two_shift(image_height);
+    init_texture(texture, 1 << width_shift, 1 << height_shift);
+    bool has_alpha = false;
+
+    for (int y = 0; y < texture->height; y++) {
+        int image_y = (int)(((int64_t)y * image_height) >> height_shift);
+        for (int x = 0; x < texture->width; x++) {
+            int image_x = (int)(((int64_t)x * image_width) >> width_shift);
+            const unsigned char* pixel = &image[((image_y * image_width) + image_x) * components];
+            unsigned char* texel = (unsigned char*)&texture->texels[texture->x_offsets[x] + texture->y_offsets[y]];
+            texel[0] = pixel[0];
+            texel[1] = pixel[1];
+            texel[2] = pixel[2];
+            texel[3] = (components == 4) ? pixel[3] : 0xFF;
+            has_alpha |= (texel[3] != 0xFF);
+        }
+    }
+
+    build_mipmaps(texture);
+    if (is_texture_compression) {
+        int format = has_alpha ? TEXTURE_FORMAT_BC3 : TEXTURE_FORMAT_BC1;
+        compress_texture(texture, format);
+        for (int i = 0; i < texture->num_mipmaps; i++) {
+            compress_texture(&texture->mipmaps[i], format);
+        }
+    }
+    return texture;
+}
+
+
+texture_t* load_png_texture(char* filename) {
+    upng_t* png_image = upng_new_from_file(filename);
+    if (png_image == NULL) {
+        return NULL;
+    }
+    upng_decode(png_image);
+    upng_format format = upng_get_format(png_image);
+    if (upng_get_error(png_image) != UPNG_EOK || (format != UPNG_RGBA8 && format != UPNG_RGB8)) {
+        upng_free(png_image);
+        return NULL;
+    }
+
+    texture_t* texture = create_image_texture(
+        upng_get_buffer(png_image),
+        upng_get_width(png_image),
+        upng_get_height(png_image),
+        upng_get_components(png_image)
+    );
+    upng_free(png_image);
+    return texture;
+}
+
+
+// ----- TEXTURE OF A SINGLE TEXEL, STANDS IN FOR IMAGES THAT CAN NOT BE LOADED -----
+texture_t* create_solid_texture(uint32_t color) {
+    texture_t* texture = (texture_t*)malloc(sizeof(texture_t));
+    init_texture(texture, 1, 1);
+    texture->texels[0] = color;
+    return texture;
+}
+
+
+void free_texture(texture_t* texture) {
+    if (texture != NULL) {
+        for (int i = 0; i < texture->num_mipmaps; i++) {
+            free(texture->mipmaps[i].texels);
+            free(texture->mipmaps[i].blocks);
+            free(texture->mipmaps[i].x_offsets);
+            free(texture->mipmaps[i].y_offsets);
+        }
+        free(texture->mipmaps);
+        free(texture->texels);
+        free(texture->blocks);
+        free(texture->x_offsets);
+        free(texture->y_offsets);
+        free(texture);
+    }
+}
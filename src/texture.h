@@ -1,12 +1,143 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef struct {
     float u;
     float v;
 } tex2_t;
 
+// texel formats of texture_t; block compressed textures hold 4x4 texels in 64 bit words
+// that the sampler decodes texel by texel
+enum texture_format {
+    TEXTURE_FORMAT_RGBA32,     // bytes R, G, B, A in memory, same as the color buffer
+    TEXTURE_FORMAT_BC1,        // opaque, 4 bits per texel: one color block
+    TEXTURE_FORMAT_BC3         // with alpha, 8 bits per texel: one alpha block, one color block
+};
+
+// color block: two RGB565 endpoints and a 2 bit index per texel, row after row; the
+// palette is the endpoints and two colors between them, or with color0 <= color1 the
+// endpoints, their average and transparent black
+//
+//   bits  0..15  color0       index 0: color0               index 2: (2 color0 + color1) / 3
+//   bits 16..31  color1       index 1: color1               index 3: (color0 + 2 color1) / 3
+//   bits 32..63  16 indices
+//
+// alpha block: two 8 bit endpoints and a 3 bit index per texel; with alpha0 > alpha1 the
+// palette is the endpoints and 6 alphas between them, otherwise the endpoints, 4 alphas
+// between them, 0 and 255
+//
+//   bits  0..7   alpha0
+//   bits  8..15  alpha1
+//   bits 16..63  16 indices
+
+// order of texels in memory, picked at load with set_texture_layout(); tiled and Z-order
+// layouts keep texels that are close in 2D close in memory, so triangles that walk the
+// texture vertically or diagonally touch fewer cache lines than with rows
+//
+//   linear          tiled 4x4                 Z-order (Morton)
+//   0  1  2  3      0  1  2  3 | 16 17 ..     0  1  4  5
+//   4  5  6  7      4  5  6  7 |              2  3  6  7
+//   8  9 10 11      8  9 10 11 |              8  9 12 13
+//  12 13 14 15     12 13 14 15 |             10 11 14 15
+//
+enum texture_layout {
+    TEXTURE_LAYOUT_LINEAR,
+    TEXTURE_LAYOUT_TILED_4,
+    TEXTURE_LAYOUT_TILED_8,
+    TEXTURE_LAYOUT_MORTON
+};
+
+// texture owned by the renderer, decoded at load with everything the sampler needs
+// precomputed: dimensions are powers of two, so wrapping a texel coordinate is one and,
+// and the position of texel (x, y) in any layout is x_offsets[x] + y_offsets[y];
+// in block compressed formats the offsets address the block that holds the texel;
+// the smaller levels of its mipmap chain are textures of their own
+typedef struct texture {
+    uint32_t* texels;          // RGBA32 texels, NULL in block compressed formats
+    uint64_t* blocks;          // BC1 and BC3 blocks, 4x4 blocks in rows, NULL in RGBA32
+    int block_shift;           // log2 of the 64 bit words of a block
+    int width;
+    int height;
+    int width_mask;            // width - 1
+    int height_mask;           // height - 1
+    int pitch;                 // texels from the start of one row to the next in linear layout
+    int format;
+    int layout;
+    int* x_offsets;            // width entries
+    int* y_offsets;            // height entries
+    struct texture* mipmaps;   // levels 1..num_mipmaps, each half the size of the one before
+    int num_mipmaps;
+} texture_t;
+
+// level 0 is the texture itself
+static inline const texture_t* get_texture_level(const texture_t* texture, int level) {
+    return (level == 0) ? texture : &texture->mipmaps[level - 1];
+}
+
+// texel at wrapped coordinates 0 <= x < width, 0 <= y < height
+static inline uint32_t get_texel(const texture_t* texture, int x, int y) {
+    return texture->texels[texture->x_offsets[x] + texture->y_offsets[y]];
+}
+
+// RGB565 to 8 bit red, green and blue in 21 bit lanes of a 64 bit integer, the low bits
+// repeat the high ones so 31 and 63 map to 255
+static inline uint64_t expand_rgb565(uint32_t color) {
+    uint64_t r = (color >> 11) & 0x1F;
+    uint64_t g = (color >> 5) & 0x3F;
+    uint64_t b = color & 0x1F;
+    return ((r << 3) | (r >> 2)) | (((g << 2) | (g >> 4)) << 21) | (((b << 3) | (b >> 2)) << 42);
+}
+
+// [color0 > color1][index] weights of color0 and color1 in sixths, and alpha
+static const uint32_t color_block_palette[2][4][3] = {
+    { { 6, 0, 0xFF000000 }, { 0, 6, 0xFF000000 }, { 3, 3, 0xFF000000 }, { 0, 0, 0 } },
+    { { 6, 0, 0xFF000000 }, { 0, 6, 0xFF000000 }, { 4, 2, 0xFF000000 }, { 2, 4, 0xFF000000 } }
+};
+
+// texel index (0..15) of a color block; the palette color is blended in all three lanes at
+// once, every lane stays below 2^21 and x * 683 >> 12 is x / 6 for every lane value
+static inline uint32_t decode_color_block(uint64_t block, int index) {
+    uint32_t color0 = (uint32_t)block & 0xFFFF;
+    uint32_t color1 = (uint32_t)(block >> 16) & 0xFFFF;
+    const uint32_t* palette = color_block_palette[color0 > color1][(block >> (32 + 2 * index)) & 3];
+    uint64_t rgb = ((expand_rgb565(color0) * palette[0] + expand_rgb565(color1) * palette[1]) * 683) >> 12;
+    return ((uint32_t)rgb & 0xFF) | (((uint32_t)(rgb >> 21) & 0xFF) << 8) | (((uint32_t)(rgb >> 42) & 0xFF) << 16) | palette[2];
+}
+
+// [alpha0 > alpha1][index] weights of alpha0 and alpha1 in 35ths, and alpha added to them
+static const uint32_t alpha_block_palette[2][8][3] = {
+    { { 35, 0, 0 }, { 0, 35, 0 }, { 28, 7, 0 }, { 21, 14, 0 }, { 14, 21, 0 }, { 7, 28, 0 }, { 0, 0, 0 }, { 0, 0, 255 } },
+    { { 35, 0, 0 }, { 0, 35, 0 }, { 30, 5, 0 }, { 25, 10, 0 }, { 20, 15, 0 }, { 15, 20, 0 }, { 10, 25, 0 }, { 5, 30, 0 } }
+};
+
+// texel index (0..15) of an alpha block; x * 29960 >> 20 is x / 35 for x up to 35 * 255
+static inline uint32_t decode_alpha_block(uint64_t block, int index) {
+    uint32_t alpha0 = (uint32_t)block & 0xFF;
+    uint32_t alpha1 = (uint32_t)(block >> 8) & 0xFF;
+    const uint32_t* palette = alpha_block_palette[alpha0 > alpha1][(block >> (16 + 3 * index)) & 7];
+    return (((alpha0 * palette[0] + alpha1 * palette[1]) * 29960) >> 20) + palette[2];
+}
+
+// texel at wrapped coordinates of a BC1 or BC3 texture
+static inline __attribute__((always_inline)) uint32_t get_block_texel(const texture_t* texture, int x, int y) {
+    const uint64_t* block = &texture->blocks[(texture->x_offsets[x] + texture->y_offsets[y]) << texture->block_shift];
+    int index = ((y & 3) << 2) | (x & 3);
+    if (texture->format == TEXTURE_FORMAT_BC3) {
+        return (decode_color_block(block[1], index) & 0x00FFFFFF) | (decode_alpha_block(block[0], index) << 24);
+    }
+    return decode_color_block(block[0], index);
+}
 
 tex2_t tex2_clone(tex2_t* t);
 
+void set_texture_layout(int layout);
+void set_texture_compression(bool enabled);
+texture_t* create_image_texture(const unsigned char* image, int image_width, int image_height, int components);
+texture_t* load_png_texture(char* filename);
+texture_t* create_solid_texture(uint32_t color);
+void free_texture(texture_t* texture);
+
 #endif
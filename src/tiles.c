@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include "tiles.h"
+#include "display.h"
+#include "workers.h"
+
+// list of triangles overlapping one screen tile, in the order they were submitted
+typedef struct {
+    rect_t rect;
+    int* triangle_indices;
+    int num_triangles;
+    int capacity;
+    shading_scratch_t shading_scratch;    // setups of the visibility buffer shading pass
+    int depth_writes;      // pixels that passed the depth test in the depth pre-pass
+    int covered_pixels;    // pixels covered by any triangle, shaded once each
+} tile_t;
+
+static tile_t* tiles = NULL;
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+
+// triangles of current frame, binned by bin_triangles()
+static triangle_t* binned_triangles = NULL;
+
+
+// ----- SPLIT WINDOW INTO TILE_SIZE x TILE_SIZE TILES -----
+//
+//   +------+------+------+--+
+//   |  0   |  1   |  2   |3 |
+//   +------+------+------+--+
+//   |  4   |  5   |  6   |7 |  <-- tiles on right and bottom border may be smaller
+//   +------+------+------+--+
+//
+void init_tiles(void) {
+    num_tiles_x = (get_window_width() + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (get_window_height() + TILE_SIZE - 1) / TILE_SIZE;
+    tiles = (tile_t*)calloc(num_tiles_x * num_tiles_y, sizeof(tile_t));
+
+    for (int ty = 0; ty < num_tiles_y; ty++) {
+        for (int tx = 0; tx < num_tiles_x; tx++) {
+            tile_t* tile = &tiles[(ty * num_tiles_x) + tx];
+            tile->rect.min_x = tx * TILE_SIZE;
+            tile->rect.min_y = ty * TILE_SIZE;
+            tile->rect.max_x = tile->rect.min_x + TILE_SIZE - 1;
+            tile->rect.max_y = tile->rect.min_y + TILE_SIZE - 1;
+            if (tile->rect.max_x > get_window_width() - 1) tile->rect.max_x = get_window_width() - 1;
+            if (tile->rect.max_y > get_window_height() - 1) tile->rect.max_y = get_window_height() - 1;
+        }
+    }
+}
+
+
+static void tile_push_triangle(tile_t* tile, int triangle_index) {
+    if (tile->num_triangles == tile->capacity) {
+        tile->capacity = (tile->capacity == 0) ? 64 : tile->capacity * 2;
+        tile->triangle_indices = (int*)realloc(tile->triangle_indices, sizeof(int) * tile->capacity);
+    }
+    tile->triangle_indices[tile->num_triangles++] = triangle_index;
+}
+
+
+// ----- ADD EVERY TRIANGLE TO ALL TILES OVERLAPPED BY ITS SCREEN BOUNDING BOX -----
+void bin_triangles(triangle_t* triangles, int num_triangles) {
+    binned_triangles = triangles;
+    for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+        tiles[i].num_triangles = 0;
+    }
+
+    for (int i = 0; i < num_triangles; i++) {
+        triangle_t* triangle = &triangles[i];
+
+        // same float to int conversion used when the triangle is drawn
+        int x0 = triangle->points[0].x, y0 = triangle->points[0].y;
+        int x1 = triangle->points[1].x, y1 = triangle->points[1].y;
+        int x2 = triangle->points[2].x, y2 = triangle->points[2].y;
+
+        // grow box so it also covers the vertex rectangles drawn around every vertex
+        int min_x = (x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2)) - 4;
+        int min_y = (y0 < y1 ? (y0 < y2 ? y0 : y2) : (y1 < y2 ? y1 : y2)) - 4;
+        int max_x = (x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2)) + 4;
+        int max_y = (y0 > y1 ? (y0 > y2 ? y0 : y2) : (y1 > y2 ? y1 : y2)) + 4;
+
+        // convert box to tile coordinates clamped to the tile grid
+        int min_tx = min_x < 0 ? 0 : min_x / TILE_SIZE;
+        int min_ty = min_y < 0 ? 0 : min_y / TILE_SIZE;
+        int max_tx = max_x / TILE_SIZE;
+        int max_ty = max_y / TILE_SIZE;
+        if (max_tx > num_tiles_x - 1) max_tx = num_tiles_x - 1;
+        if (max_ty > num_tiles_y - 1) max_ty = num_tiles_y - 1;
+
+        for (int ty = min_ty; ty <= max_ty; ty++) {
+            for (int tx = min_tx; tx <= max_tx; tx++) {
+                tile_push_triangle(&tiles[(ty * num_tiles_x) + tx], i);
+            }
+        }
+    }
+}
+
+
+// ----- CLEAR AND DRAW ALL TRIANGLES OF A SINGLE TILE -----
+// a tile only touches the pixels inside its own rectangle, so tiles can be rendered
+// by different threads without locks; within a tile triangles keep their submission
+// order, which makes the final image independent of the number of worker threads
+static void render_tile(int tile_index, void* data) {
+    tile_t* tile = &tiles[tile_index];
+    rect_t clip = tile->rect;
+
+    // clear the tile slice of color buffer and z-buffer
+    clear_color_buffer(0xFF000000, clip);
+    clear_z_buffer(clip);
+
+    draw_grid(clip);
+
+    bool is_filling = should_render_filled_triangles() || should_render_textured_triangles();
+
+    // visibility buffer and depth pre-pass both rely on depth test and depth write
+    bool is_depth_buffered = is_depth_test_enabled() && is_depth_write_enabled();
+    bool is_deferred = is_filling && is_depth_buffered && is_visibility_buffer_enabled();
+
+    // visibility buffer: the raster pass stores depth and triangle id of every pixel, then
+    // one pass over the tile fetches texels for the pixels that ended up on screen; raster
+    // cost no longer depends on shading cost, wireframes are drawn over the shaded tile
+    if (is_deferred) {
+        clear_id_buffer(clip);
+        for (int i = 0; i < tile->num_triangles; i++) {
+            triangle_t triangle = binned_triangles[tile->triangle_indices[i]];
+            draw_triangle_id(
+                triangle.points[0].x, triangle.points[0].y, triangle.points[0].w, // vertex A
+                triangle.points[1].x, triangle.points[1].y, triangle.points[1].w, // vertex B
+                triangle.points[2].x, triangle.points[2].y, triangle.points[2].w, // vertex C
+                i + 1, clip
+            );
+        }
+        shade_visibility_buffer(binned_triangles, tile->triangle_indices, tile->num_triangles, should_render_textured_triangles(), clip, &tile->shading_scratch);
+    }
+
+    // depth pre-pass: resolve visibility of the whole tile first, so the shading pass below
+    // only colors (and fetches texels for) the pixels that end up on screen
+    tile->depth_writes = 0;
+    tile->covered_pixels = 0;
+    if (!is_deferred && is_filling && is_depth_buffered && is_depth_prepass_enabled()) {
+        for (int i = 0; i < tile->num_triangles; i++) {
+            triangle_t triangle = binned_triangles[tile->triangle_indices[i]];
+            draw_triangle_depth(
+                triangle.points[0].x, triangle.points[0].y, triangle.points[0].w, // vertex A
+                triangle.points[1].x, triangle.points[1].y, triangle.points[1].w, // vertex B
+                triangle.points[2].x, triangle.points[2].y, triangle.points[2].w, // vertex C
+                &tile->depth_writes, clip
+            );
+        }
+        tile->covered_pixels = finish_depth_prepass(clip);
+    }
+
+    // loop all triangles overlapping the tile and render them
+    for (int i = 0; i < tile->num_triangles; i++) {
+        triangle_t triangle = binned_triangles[tile->triangle_indices[i]];
+
+        // draw filled triangle
+        if (!is_deferred && should_render_filled_triangles()) {
+            draw_filled_triangle(
+                triangle.points[0].x, triangle.points[0].y, triangle.points[0].w, // vertex A
+                triangle.points[1].x, triangle.points[1].y, triangle.points[1].w, // vertex B
+                triangle.points[2].x, triangle.points[2].y, triangle.points[2].w, // vertex C
+                triangle.color, clip
+            );
+        }
+
+        // draw textured triangle
+        if (!is_deferred && should_render_textured_triangles()) {
+            draw_textured_triangle(
+                triangle.points[0].x, triangle.points[0].y, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v, // vertex A
+                triangle.points[1].x, triangle.points[1].y, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v, // vertex B
+                triangle.points[2].x, triangle.points[2].y, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v, // vertex C
+                triangle.texture, triangle.light_intensity, clip
+            );
+        }
+
+        // draw triangle wireframe
+        if (should_render_wireframe()) {
+            draw_triangle(
+                triangle.points[0].x, triangle.points[0].y, // vertex A
+                triangle.points[1].x, triangle.points[1].y, // vertex B
+                triangle.points[2].x, triangle.points[2].y, // vertex C
+                0xFFFFFFFF, clip
+            );
+        }
+
+        // draw triangle vertex points
+        if (should_render_wire_vertex()) {
+            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFF0000, clip); // vertex A
+            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFF0000, clip); // vertex B
+            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFF0000, clip); // vertex C
+        }
+    }
+}
+
+
+// ----- RENDER ALL TILES ON THE WORKER THREADS -----
+// span kernels for the render state are picked once for the whole frame
+void render_tiles(void) {
+    select_span_kernels();
+    run_parallel_jobs(num_tiles_x * num_tiles_y, render_tile, NULL);
+}
+
+
+// ----- AVERAGE NUMBER OF TIMES A COVERED PIXEL WOULD BE SHADED WITHOUT DEPTH PRE-PASS -----
+// measured by the depth pre-pass of the last rendered frame, 0 when it was not enabled
+float get_overdraw_factor(void) {
+    int depth_writes = 0;
+    int covered_pixels = 0;
+    for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+        depth_writes += tiles[i].depth_writes;
+        covered_pixels += tiles[i].covered_pixels;
+    }
+    return covered_pixels > 0 ? (float)depth_writes / covered_pixels : 0;
+}
+
+
+void free_tiles(void) {
+    for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+        free(tiles[i].triangle_indices);
+        free_shading_scratch(&tiles[i].shading_scratch);
+    }
+    free(tiles);
+    tiles = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include "triangle.h"
+
+// screen is split in square tiles that are rasterized independently by worker threads,
+// must be a multiple of HZ_BLOCK_SIZE so no hierarchical z block is shared by two tiles
+#define TILE_SIZE 64
+
+void init_tiles(void);
+void bin_triangles(triangle_t* triangles, int num_triangles);
+void render_tiles(void);
+float get_overdraw_factor(void);
+void free_tiles(void);
+
+#endif
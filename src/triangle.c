@@ -1,11 +1,34 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "display.h"
 #include "triangle.h"
 #include "swap.h"
 #include "vector.h"
+#include "light.h"
+#include "cpu.h"
 
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 
-// ----- RETURN BAYCENTRIC WEIGHTS ALPHA, BETA, AND GAMMA FOR POINT P -----
+
+// ----- SCREEN COORDINATES IN 28.4 FIXED POINT -----
+// vertices are snapped to 1/16 of a pixel and pixels are sampled at their centers, so
+// triangles move smoothly below one pixel and neighbours share exactly the same edges
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+
+static int to_fixed(float value) {
+    return (int)floor(value * SUBPIXEL_SCALE + 0.5f);
+}
+
+
+// ----- EDGE FUNCTION OF POINT P RELATIVE TO DIRECTED EDGE A->B -----
+// twice the signed area of triangle ABP in 28.4 coordinates; positive when P is on the
+// inner side of a counter-clockwise (in screen space) triangle, zero on the edge itself;
+// products of guard band coordinates do not fit in 32 bits, so setup is done in 64 bits
 //
 //         (B)
 //         /|\
@@ -17,341 +40,1509 @@
 //   //           \\
 //  (A)------------(C)
 //
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-    // find vectors between vertices ABC and point p
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t ap = vec2_sub(p, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
+static int64_t edge_function(int ax, int ay, int bx, int by, int px, int py) {
+    return (int64_t)(bx - ax) * (py - ay) - (int64_t)(by - ay) * (px - ax);
+}
 
-    // compute area of full parallegram/triangle ABC using 2D cross product
-    float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x); // || AC x AB ||
 
-    // alpha is area of small parallelogram/triangle PBC divided by area of full parallelogram/triangle ABC
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
+// ----- TWICE THE SIGNED AREA OF A SCREEN SPACE TRIANGLE AFTER SNAPPING -----
+static int64_t get_fixed_triangle_area(float x0, float y0, float x1, float y1, float x2, float y2) {
+    return edge_function(to_fixed(x0), to_fixed(y0), to_fixed(x1), to_fixed(y1), to_fixed(x2), to_fixed(y2));
+}
+
 
-    // beta is area of small parallelogram/triangle APC divided by area of full parallelogram/triangle ABC
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
+// ----- DRAW TRIANGLE USING THREE RAW LINE CALLS -----
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, rect_t clip) {
+    draw_line(x0, y0, x1, y1, color, clip);
+    draw_line(x1, y1, x2, y2, color, clip);
+    draw_line(x2, y2, x0, y0, color, clip);
+}
 
-    // weight gamma is easily found since barycentric coordinates always add up to 1.0
-    float gamma = 1 - alpha - beta;
 
-    vec3_t weights = { alpha, beta, gamma };
-    return weights;
+// ----- SETUP EDGE FUNCTIONS AND ATTRIBUTE GRADIENTS SHARED BY FILLED & TEXTURED TRIANGLES -----
+// every value that varies linearly across the triangle in screen space (edge functions,
+// 1/w, u/w, v/w) is written as value(x,y) = value(x0,y0) + dx * (x-x0) + dy * (y-y0),
+// so walking the bounding box needs no divisions once the gradients are known
+//
+// edge functions are exact integers: the 28.4 value at pixel centers is biased by the fill
+// rule and divided by 16 rounding down, which keeps its sign and turns the step between two
+// pixels into a whole number; edges that do not cross the bounding box are replaced by a
+// constant, so the values that remain are bounded by the box and fit in 32 bits
+typedef struct {
+    int min_x, min_y, max_x, max_y;   // bounding box clamped to clip rectangle
+    int e0, e1, e2;                   // edge functions at (min_x, min_y)
+    int e0_dx, e1_dx, e2_dx;          // edge function steps along x
+    int e0_dy, e1_dy, e2_dy;          // edge function steps along y
+    float x[3], y[3];                 // snapped vertex positions, for attribute gradients
+} edge_setup_t;
+
+typedef struct {
+    float value;                      // attribute at (min_x, min_y)
+    float dx;                         // attribute step along x
+    float dy;                         // attribute step along y
+} attribute_setup_t;
+
+static int64_t floor_div_subpixel(int64_t value) {
+    return (value >= 0) ? value / SUBPIXEL_SCALE : -((-value + SUBPIXEL_SCALE - 1) / SUBPIXEL_SCALE);
 }
 
 
-// ----- DRAW TRIANGLE USING THREE RAW LINE CALLS -----
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color) {
-    draw_line(x0, y0, x1, y1, color);
-    draw_line(x1, y1, x2, y2, color);
-    draw_line(x2, y2, x0, y0, color);
+// ----- TOP-LEFT FILL RULE -----
+// a pixel center exactly on an edge belongs to the triangle only if the edge is a top edge
+// (horizontal, triangle below it) or a left edge (triangle on its right); two triangles
+// sharing an edge see it with opposite directions, so exactly one of them draws the pixel
+//
+//        top edge
+//      A---------->B        screen y grows down, inside is where the edge function
+//       ^         /         is positive; with A->B->C counter-clockwise in edge
+//  left  \       /          function terms a top edge goes right (dy == 0, dx > 0)
+//  edge   \     /           and a left edge goes up (dy < 0)
+//          \   v
+//           \ /
+//            C
+//
+static bool is_top_left_edge(int ax, int ay, int bx, int by) {
+    return (by == ay && bx > ax) || by < ay;
 }
 
 
-// ----- DRAW SOLID PIXEL AT POSITION (x,y) USING DEPTH INTERPOLATION -----
-void draw_triangle_pixel(
-    int x, int y, uint32_t color,
-    vec4_t point_a, vec4_t point_b, vec4_t point_c
+// ----- SETUP ONE EDGE OVER THE BOUNDING BOX, FALSE IF THE BOX IS FULLY OUTSIDE OF IT -----
+static bool setup_edge(
+    const edge_setup_t* setup, int ax, int ay, int bx, int by,
+    int* e, int* e_dx, int* e_dy
 ) {
-    // create three vec2 to find interpolation
-    vec2_t p = { x, y };
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
+    // 28.4 position of the center of the first pixel of the box
+    int px = (setup->min_x << SUBPIXEL_BITS) + SUBPIXEL_SCALE / 2;
+    int py = (setup->min_y << SUBPIXEL_BITS) + SUBPIXEL_SCALE / 2;
+    int64_t bias = is_top_left_edge(ax, ay, bx, by) ? 0 : -1;
+    int64_t value = edge_function(ax, ay, bx, by, px, py) + bias;
+    int64_t step_x = (int64_t)(ay - by) * SUBPIXEL_SCALE;
+    int64_t step_y = (int64_t)(bx - ax) * SUBPIXEL_SCALE;
+
+    // the edge function is linear, so its extremes over the box are at the box corners
+    int64_t width = setup->max_x - setup->min_x;
+    int64_t height = setup->max_y - setup->min_y;
+    int64_t corners[4] = { value, value + width * step_x, value + height * step_y, value + width * step_x + height * step_y };
+    int64_t min_value = corners[0], max_value = corners[0];
+    for (int i = 1; i < 4; i++) {
+        if (corners[i] < min_value) min_value = corners[i];
+        if (corners[i] > max_value) max_value = corners[i];
+    }
 
-    // calculate barycentric coordinates of point 'p' inside triangle
-    vec3_t weights = barycentric_weights(a, b, c, p);
+    if (max_value < 0) {
+        return false;
+    }
+    if (min_value >= 0) {
+        *e = 0;
+        *e_dx = 0;
+        *e_dy = 0;
+        return true;
+    }
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+    // edge crosses the box; boxes are at most one screen tile, so values stay far below 2^31
+    *e = (int)floor_div_subpixel(value);
+    *e_dx = ay - by;
+    *e_dy = bx - ax;
+    return true;
+}
 
-    // interpolate value of 1/w for current pixel
-    float interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+static bool setup_triangle_edges(
+    edge_setup_t* setup,
+    float x0, float y0, float x1, float y1, float x2, float y2,
+    rect_t clip
+) {
+    int fx0 = to_fixed(x0), fy0 = to_fixed(y0);
+    int fx1 = to_fixed(x1), fy1 = to_fixed(y1);
+    int fx2 = to_fixed(x2), fy2 = to_fixed(y2);
 
-    // adjust 1/w so pixels that are closer to camera have smaller values
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+    // twice the signed area; callers make sure vertices are counter-clockwise before setup
+    if (edge_function(fx0, fy0, fx1, fy1, fx2, fy2) <= 0) {
+        return false;
+    }
 
-    // only draw pixel if depth value is less than the one previously stored in z-buffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x,y)) {
-        // draw pixel at position (x,y) with solid color
-        draw_pixel(x, y, color);
+    // bounding box of pixel centers inside the triangle bounds, clamped to the clip rectangle
+    // (window or screen tile); the center of pixel x is at 16 * x + 8 in 28.4
+    int min_fx = fx0 < fx1 ? (fx0 < fx2 ? fx0 : fx2) : (fx1 < fx2 ? fx1 : fx2);
+    int min_fy = fy0 < fy1 ? (fy0 < fy2 ? fy0 : fy2) : (fy1 < fy2 ? fy1 : fy2);
+    int max_fx = fx0 > fx1 ? (fx0 > fx2 ? fx0 : fx2) : (fx1 > fx2 ? fx1 : fx2);
+    int max_fy = fy0 > fy1 ? (fy0 > fy2 ? fy0 : fy2) : (fy1 > fy2 ? fy1 : fy2);
+    setup->min_x = (min_fx - SUBPIXEL_SCALE / 2 + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    setup->min_y = (min_fy - SUBPIXEL_SCALE / 2 + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    setup->max_x = (max_fx - SUBPIXEL_SCALE / 2) >> SUBPIXEL_BITS;
+    setup->max_y = (max_fy - SUBPIXEL_SCALE / 2) >> SUBPIXEL_BITS;
+    if (setup->min_x < clip.min_x) setup->min_x = clip.min_x;
+    if (setup->min_y < clip.min_y) setup->min_y = clip.min_y;
+    if (setup->max_x > clip.max_x) setup->max_x = clip.max_x;
+    if (setup->max_y > clip.max_y) setup->max_y = clip.max_y;
+    if (setup->min_x > setup->max_x || setup->min_y > setup->max_y) {
+        return false;
+    }
 
-        // update z-buffer value with 1/w of this current pixel
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+    // e0 is opposite to vertex 0, e1 opposite to vertex 1, and e2 opposite to vertex 2
+    if (!setup_edge(setup, fx1, fy1, fx2, fy2, &setup->e0, &setup->e0_dx, &setup->e0_dy) ||
+        !setup_edge(setup, fx2, fy2, fx0, fy0, &setup->e1, &setup->e1_dx, &setup->e1_dy) ||
+        !setup_edge(setup, fx0, fy0, fx1, fy1, &setup->e2, &setup->e2_dx, &setup->e2_dy)) {
+        return false;
     }
+
+    setup->x[0] = (float)fx0 / SUBPIXEL_SCALE; setup->y[0] = (float)fy0 / SUBPIXEL_SCALE;
+    setup->x[1] = (float)fx1 / SUBPIXEL_SCALE; setup->y[1] = (float)fy1 / SUBPIXEL_SCALE;
+    setup->x[2] = (float)fx2 / SUBPIXEL_SCALE; setup->y[2] = (float)fy2 / SUBPIXEL_SCALE;
+    return true;
 }
 
+static attribute_setup_t setup_triangle_attribute(const edge_setup_t* setup, float a0, float a1, float a2) {
+    // plane through the three vertex values, evaluated at the center of the first pixel
+    double x10 = setup->x[1] - setup->x[0], y10 = setup->y[1] - setup->y[0];
+    double x20 = setup->x[2] - setup->x[0], y20 = setup->y[2] - setup->y[0];
+    double area = x10 * y20 - x20 * y10;
+    double dx = ((a1 - a0) * y20 - (a2 - a0) * y10) / area;
+    double dy = ((a2 - a0) * x10 - (a1 - a0) * x20) / area;
+    attribute_setup_t attribute = {
+        .value = a0 + dx * (setup->min_x + 0.5 - setup->x[0]) + dy * (setup->min_y + 0.5 - setup->y[0]),
+        .dx = dx,
+        .dy = dy
+    };
+    return attribute;
+}
 
-// ----- DRAW TEXTURED PIXEL AT POSITION (x,y) USING INTERPOLATION -----
-void draw_triangle_texel(
-    int x, int y, upng_t* texture,
-    vec4_t point_a, vec4_t point_b, vec4_t point_c,
-    tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
-) {
-    vec2_t p = { x, y };
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
 
-    // calculate barycentric coordinates of point 'p' inside triangle
-    vec3_t weights = barycentric_weights(a, b, c, p);
+// ----- ONE ROW OF A TRIANGLE INSIDE ITS BOUNDING BOX -----
+// span kernels evaluate every pixel as value + i * dx from the start of the row instead of
+// accumulating dx, so scalar and vector kernels produce exactly the same depth and texels
+typedef struct {
+    uint32_t* color_row;              // color buffer at (min_x, y)
+    float* z_row;                     // z-buffer at (min_x, y)
+    int count;                        // number of pixels between min_x and max_x
+    int e0, e1, e2;                   // edge functions at (min_x, y)
+    int e0_dx, e1_dx, e2_dx;          // edge function steps along x
+    float reciprocal_w, reciprocal_w_dx;
+    float u_over_w, u_over_w_dx;
+    float v_over_w, v_over_w_dx;
+    uint32_t color;                   // solid color of filled triangles
+    texture_t texture;                // sampling descriptor of textured triangles
+    float light_intensity;            // texel scale of lit textured triangles, 0..1
+    int* depth_writes;                // pixels written by depth-only spans
+    int subdivision;                  // pixels between exact perspective divides of subdivided spans
+} span_t;
+
+// span kernels draw pixels first..count-1 of a span
+typedef void (*span_kernel_t)(const span_t* span, int first);
+
+// kernels for the render state of current frame, picked by select_span_kernels()
+static span_kernel_t draw_filled_span = NULL;
+static span_kernel_t draw_textured_span = NULL;
+static span_kernel_t draw_subdivided_span = NULL;
+static span_kernel_t draw_compressed_span = NULL;
+
+// fastest kernels of current CPU, picked by init_triangle_kernels(); depth-only and id
+// spans always test and write depth
+static span_kernel_t draw_filled_span_vector = NULL;
+static span_kernel_t draw_textured_span_vector = NULL;
+static span_kernel_t draw_bilinear_span_vector = NULL;
+static span_kernel_t draw_depth_span = NULL;
+static span_kernel_t draw_id_span = NULL;
+
+
+// ----- FETCH TEXEL FOR TRUNCATED TEXTURE COORDINATES -----
+// abs wrap only: used by the vector kernels, which select_span_kernels() picks for the abs
+// wrap state alone; every other wrap mode goes through wrap_texel_coordinate()
+static uint32_t get_span_texel(const span_t* span, int tex_x, int tex_y) {
+    // mirror negative coordinates and wrap them into the power of two texture size
+    tex_x = abs(tex_x) & span->texture.width_mask;
+    tex_y = abs(tex_y) & span->texture.height_mask;
+    return get_texel(&span->texture, tex_x, tex_y);
+}
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
 
-    // variables to store interpolated values of U, V, and also 1/w for current pixel
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_reciprocal_w;
+// ----- FETCH TEXEL AT WRAPPED COORDINATES OF AN RGBA32 OR BLOCK COMPRESSED TEXTURE -----
+// compressed is a constant in the kernels, so they read texels or decode blocks without a
+// branch per texel; forced inline, as a call would keep the branch and cost more than the
+// fetch itself
+static inline __attribute__((always_inline)) uint32_t fetch_texel(const texture_t* texture, int x, int y, bool compressed) {
+    return compressed ? get_block_texel(texture, x, y) : get_texel(texture, x, y);
+}
 
-    // perform interpolation of all U/w and V/w values using barycentric weights and a factor of 1/w
-    interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-    interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
 
-    // also interpolate value of 1/w for current pixel
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+// ----- MAP A TEXTURE COORDINATE SCALED TO TEXELS INTO 0..mask -----
+// wrap is a constant in every kernel that inlines this, so only one case is compiled in;
+// mask is the texture size - 1, and with two's complement integers the and of repeat is
+// also the right modulo for negative coordinates
+static inline int wrap_texel_coordinate(float texel, int mask, int wrap) {
+    int coordinate;
+    switch (wrap) {
+        case TEXTURE_WRAP_REPEAT:
+            return (int)floorf(texel) & mask;
+        case TEXTURE_WRAP_CLAMP:
+            coordinate = (int)texel;
+            return (coordinate < 0) ? 0 : (coordinate > mask) ? mask : coordinate;
+        default:
+            return abs((int)texel) & mask;
+    }
+}
 
-    // divide back both interpolated values by 1/w
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
 
-    // get mesh teture witdh & height dimenstions
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
+// ----- WRAP AN INTEGER TEXEL COORDINATE INTO 0..mask -----
+static inline int wrap_texel_index(int coordinate, int mask, int wrap) {
+    switch (wrap) {
+        case TEXTURE_WRAP_REPEAT:
+            return coordinate & mask;
+        case TEXTURE_WRAP_CLAMP:
+            return (coordinate < 0) ? 0 : (coordinate > mask) ? mask : coordinate;
+        default:
+            return abs(coordinate) & mask;
+    }
+}
 
-    // map UV coordinate to full texture width and height
-    int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;  // FIXME: Quick hack to prevent buffer overflow. Needs better solution.
-    int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
 
-    // adjust 1/w so that pixels closer to camera have smaller values
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+// ----- BLEND TWO TEXELS, weight OF b IN 1/256 STEPS -----
+// red/blue and green/alpha are blended as two pairs of 16 bit lanes of one integer, each
+// lane stays below 2^16 so nothing carries into the next one; per channel this is the same
+// (a * (256 - weight) + b * weight) >> 8 the vector kernels compute in 16 bit lanes
+static inline uint32_t lerp_texels(uint32_t a, uint32_t b, uint32_t weight) {
+    uint32_t rb = (((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+    uint32_t ga = ((((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+    return rb | (ga << 8);
+}
 
-    // only draw pixel if value stored if depth value is less than the previously one stored in z-buffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-    // get buffer of colors from texture
-    uint32_t* texture_buffer = (uint32_t*) upng_get_buffer(texture);
-    // draw pixel at position (x,y) with color that comes from mapped texture
-    draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x]);
 
-    // update z-buffer value with 1/w of current pixel
-    update_zbuffer_at(x, y, interpolated_reciprocal_w);
-    }
+// ----- BILINEAR SAMPLE AT A TEXTURE COORDINATE SCALED TO TEXELS -----
+// texel centers are at .5, the four texels around the sample are blended with 8 bit
+// fractions of the distance to the first one
+//
+//   a ----- b        top    = lerp(a, b, fx)
+//   |   .   |  fy    bottom = lerp(c, d, fx)
+//   c ----- d        texel  = lerp(top, bottom, fy)
+//       fx
+//
+static inline __attribute__((always_inline)) uint32_t sample_bilinear(const texture_t* texture, float s, float t, int wrap, bool compressed) {
+    s -= 0.5f;
+    t -= 0.5f;
+    float floor_s = floorf(s);
+    float floor_t = floorf(t);
+    uint32_t fx = (uint32_t)((s - floor_s) * 256.0f);
+    uint32_t fy = (uint32_t)((t - floor_t) * 256.0f);
+
+    int x0 = wrap_texel_index((int)floor_s, texture->width_mask, wrap);
+    int x1 = wrap_texel_index((int)floor_s + 1, texture->width_mask, wrap);
+    int y0 = wrap_texel_index((int)floor_t, texture->height_mask, wrap);
+    int y1 = wrap_texel_index((int)floor_t + 1, texture->height_mask, wrap);
+
+    uint32_t top = lerp_texels(fetch_texel(texture, x0, y0, compressed), fetch_texel(texture, x1, y0, compressed), fx);
+    uint32_t bottom = lerp_texels(fetch_texel(texture, x0, y1, compressed), fetch_texel(texture, x1, y1, compressed), fx);
+    return lerp_texels(top, bottom, fy);
 }
 
 
-// ----- DRAW TEXTURED TRIANGLE BASED ON TEXTURE ARRAY OF COLORS -----
-// split original triangle in two, half flat-bottom and half flat-top.
+// ----- SPAN SUBDIVISION: ONE PERSPECTIVE DIVIDE EVERY FEW PIXELS -----
+// textured spans with span->subdivision > 1 divide u and v by 1/w exactly at the ends of
+// every segment of span->subdivision pixels and interpolate them linearly in between, like
+// the span subdivision of Quake
 //
-//        v0
-//        /\
-//       /  \
-//      /    \
-//     /      \
-//   v1--------\
-//     \_       \
-//        \_     \
-//           \_   \
-//              \_ \
-//                 \\
-//                   \
-//                    v2
+//   exact         exact         exact
+//     |-- affine --|-- affine --|-- af...
+//     s           s+N          s+2N
 //
-void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
-) {
-    // sort vertices by y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
+// on a segment where 1/w goes from q0 to q1 the affine texture coordinate is off by at most
+// |delta u| * |q1 - q0| / (4 * min(q0, q1)), delta u being the change of u over the segment;
+// segments where 1/w changes by more than SUBDIVISION_MAX_W_CHANGE (steep triangles seen at a
+// grazing angle) are divided per pixel instead, which bounds the error to
+//
+//   N * texels per pixel * SUBDIVISION_MAX_W_CHANGE / 4 texels
+//
+// i.e. at most 1/4 texel for N = 8 and 1/2 texel for N = 16 when one texel maps to one pixel;
+// depth is still interpolated exactly per pixel, so the z-buffer is the same in every mode
+#define SUBDIVISION_MAX_W_CHANGE 0.125f
+
+// bounding box pixels outside the triangle can extrapolate 1/w to zero or below
+static inline bool is_steep_segment(float start_reciprocal_w, float end_reciprocal_w) {
+    float min_reciprocal_w = fmin(start_reciprocal_w, end_reciprocal_w);
+    return min_reciprocal_w <= 0 || fabs(end_reciprocal_w - start_reciprocal_w) > SUBDIVISION_MAX_W_CHANGE * min_reciprocal_w;
+}
+
+// divide back both interpolated values of pixel i by 1/w
+static inline void get_span_texcoords(const span_t* span, int i, float reciprocal_w, float* u, float* v) {
+    *u = (span->u_over_w + (float)i * span->u_over_w_dx) / reciprocal_w;
+    *v = (span->v_over_w + (float)i * span->v_over_w_dx) / reciprocal_w;
+}
+
+
+// ----- SPAN KERNELS SPECIALIZED FOR ONE RENDER STATE -----
+// one kernel is generated for every combination of depth test, depth write, shading,
+// texture wrap, texture filter and texture compression; the state arguments are constants,
+// so the compiler removes every branch on them and the inner loop only tests coverage and
+// depth, like a hand written kernel; textured kernels walk the span in segments of
+// span->subdivision pixels, other kernels (and textured ones without subdivision) in one
+//
+//   SHADING                 writes
+//   SPAN_SHADE_DEPTH        depth only, counting pixels that pass (depth pre-pass)
+//   SPAN_SHADE_FLAT         span->color
+//   SPAN_SHADE_TEXTURED     nearest or bilinear texel
+//   SPAN_SHADE_LIT          texel scaled by span->light_intensity
+//
+#define SPAN_SHADE_DEPTH 0
+#define SPAN_SHADE_FLAT 1
+#define SPAN_SHADE_TEXTURED 2
+#define SPAN_SHADE_LIT 3
+
+#define DEFINE_SPAN_KERNEL(name, DEPTH_TEST, DEPTH_WRITE, SHADING, WRAP, FILTER, COMPRESSED)       \
+static void name(const span_t* span, int first) {                                                \
+    int e0 = span->e0 + first * span->e0_dx;                                                     \
+    int e1 = span->e1 + first * span->e1_dx;                                                     \
+    int e2 = span->e2 + first * span->e2_dx;                                                     \
+                                                                                                 \
+    bool is_subdivided = (SHADING) >= SPAN_SHADE_TEXTURED && span->subdivision > 1;              \
+    int segment_size = is_subdivided ? span->subdivision : span->count;                          \
+    float start_reciprocal_w = 0.0f, start_u = 0.0f, start_v = 0.0f;                             \
+    float end_reciprocal_w = 0.0f, end_u = 0.0f, end_v = 0.0f;                                   \
+    if (is_subdivided) {                                                                         \
+        start_reciprocal_w = span->reciprocal_w + (float)first * span->reciprocal_w_dx;          \
+        get_span_texcoords(span, first, start_reciprocal_w, &start_u, &start_v);                 \
+    }                                                                                            \
+                                                                                                 \
+    for (int start = first; start < span->count; start += segment_size) {                        \
+        int segment_end = (start + segment_size < span->count) ? start + segment_size : span->count; \
+        bool is_affine = false;                                                                  \
+        float u_step = 0.0f, v_step = 0.0f;                                                      \
+        if (is_subdivided) {                                                                     \
+            /* exact values at the first pixel of next segment, or at the last pixel of the span */ \
+            int end = (segment_end < span->count) ? segment_end : span->count - 1;               \
+            end_reciprocal_w = span->reciprocal_w + (float)end * span->reciprocal_w_dx;          \
+            get_span_texcoords(span, end, end_reciprocal_w, &end_u, &end_v);                     \
+            is_affine = !is_steep_segment(start_reciprocal_w, end_reciprocal_w);                 \
+            u_step = (end > start) ? (end_u - start_u) / (end - start) : 0;                      \
+            v_step = (end > start) ? (end_v - start_v) / (end - start) : 0;                      \
+        }                                                                                        \
+                                                                                                 \
+        for (int i = start; i < segment_end; i++) {                                              \
+            if ((e0 | e1 | e2) >= 0) {                                                           \
+                /* adjust 1/w so that pixels closer to camera have smaller values */             \
+                float reciprocal_w = span->reciprocal_w + (float)i * span->reciprocal_w_dx;      \
+                float depth = 1.0f - reciprocal_w;                                               \
+                                                                                                 \
+                if (!(DEPTH_TEST) || depth < span->z_row[i]) {                                   \
+                    if ((SHADING) == SPAN_SHADE_FLAT) {                                          \
+                        span->color_row[i] = span->color;                                        \
+                    } else if ((SHADING) != SPAN_SHADE_DEPTH) {                                  \
+                        float u, v;                                                              \
+                        if (is_affine) {                                                         \
+                            u = start_u + (float)(i - start) * u_step;                           \
+                            v = start_v + (float)(i - start) * v_step;                           \
+                        } else {                                                                 \
+                            get_span_texcoords(span, i, reciprocal_w, &u, &v);                   \
+                        }                                                                        \
+                        uint32_t texel;                                                          \
+                        if ((FILTER) == TEXTURE_FILTER_BILINEAR) {                               \
+                            texel = sample_bilinear(&span->texture, u * (float)span->texture.width, v * (float)span->texture.height, WRAP, COMPRESSED); \
+                        } else {                                                                 \
+                            int tex_x = wrap_texel_coordinate(u * (float)span->texture.width, span->texture.width_mask, WRAP);   \
+                            int tex_y = wrap_texel_coordinate(v * (float)span->texture.height, span->texture.height_mask, WRAP); \
+                            texel = fetch_texel(&span->texture, tex_x, tex_y, COMPRESSED);       \
+                        }                                                                        \
+                        if ((SHADING) == SPAN_SHADE_LIT) {                                       \
+                            texel = light_apply_intensity(texel, span->light_intensity);         \
+                        }                                                                        \
+                        span->color_row[i] = texel;                                              \
+                    }                                                                            \
+                    if (DEPTH_WRITE) {                                                           \
+                        span->z_row[i] = depth;                                                  \
+                    }                                                                            \
+                    if ((SHADING) == SPAN_SHADE_DEPTH) {                                         \
+                        (*span->depth_writes)++;                                                 \
+                    }                                                                            \
+                }                                                                                \
+            }                                                                                    \
+            e0 += span->e0_dx;                                                                   \
+            e1 += span->e1_dx;                                                                   \
+            e2 += span->e2_dx;                                                                   \
+        }                                                                                        \
+                                                                                                 \
+        start_reciprocal_w = end_reciprocal_w;                                                   \
+        start_u = end_u;                                                                         \
+        start_v = end_v;                                                                         \
+    }                                                                                            \
+}
+
+// textured and lit kernels of one depth state and texture format with nearest and bilinear
+// filters, suffixed with the wrap mode
+#define DEFINE_TEXTURED_SPAN_KERNELS(suffix, DEPTH_TEST, DEPTH_WRITE, COMPRESSED)                                                                                  \
+    DEFINE_SPAN_KERNEL(draw_textured_span_##suffix##_abs, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_ABS, TEXTURE_FILTER_NEAREST, COMPRESSED)        \
+    DEFINE_SPAN_KERNEL(draw_textured_span_##suffix##_repeat, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_REPEAT, TEXTURE_FILTER_NEAREST, COMPRESSED)  \
+    DEFINE_SPAN_KERNEL(draw_textured_span_##suffix##_clamp, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_CLAMP, TEXTURE_FILTER_NEAREST, COMPRESSED)    \
+    DEFINE_SPAN_KERNEL(draw_lit_span_##suffix##_abs, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_ABS, TEXTURE_FILTER_NEAREST, COMPRESSED)                  \
+    DEFINE_SPAN_KERNEL(draw_lit_span_##suffix##_repeat, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_REPEAT, TEXTURE_FILTER_NEAREST, COMPRESSED)            \
+    DEFINE_SPAN_KERNEL(draw_lit_span_##suffix##_clamp, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_CLAMP, TEXTURE_FILTER_NEAREST, COMPRESSED)              \
+    DEFINE_SPAN_KERNEL(draw_bilinear_span_##suffix##_abs, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_ABS, TEXTURE_FILTER_BILINEAR, COMPRESSED)       \
+    DEFINE_SPAN_KERNEL(draw_bilinear_span_##suffix##_repeat, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_REPEAT, TEXTURE_FILTER_BILINEAR, COMPRESSED) \
+    DEFINE_SPAN_KERNEL(draw_bilinear_span_##suffix##_clamp, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_TEXTURED, TEXTURE_WRAP_CLAMP, TEXTURE_FILTER_BILINEAR, COMPRESSED)   \
+    DEFINE_SPAN_KERNEL(draw_lit_bilinear_span_##suffix##_abs, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_ABS, TEXTURE_FILTER_BILINEAR, COMPRESSED)        \
+    DEFINE_SPAN_KERNEL(draw_lit_bilinear_span_##suffix##_repeat, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_REPEAT, TEXTURE_FILTER_BILINEAR, COMPRESSED)  \
+    DEFINE_SPAN_KERNEL(draw_lit_bilinear_span_##suffix##_clamp, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_LIT, TEXTURE_WRAP_CLAMP, TEXTURE_FILTER_BILINEAR, COMPRESSED)
+
+// flat kernel of one depth state, and its textured kernels for RGBA32 and block compressed
+// textures (suffixed _bc)
+#define DEFINE_SPAN_KERNELS(suffix, DEPTH_TEST, DEPTH_WRITE)                                                                            \
+    DEFINE_SPAN_KERNEL(draw_filled_span_##suffix, DEPTH_TEST, DEPTH_WRITE, SPAN_SHADE_FLAT, TEXTURE_WRAP_ABS, TEXTURE_FILTER_NEAREST, false) \
+    DEFINE_TEXTURED_SPAN_KERNELS(suffix, DEPTH_TEST, DEPTH_WRITE, false)                                                                \
+    DEFINE_TEXTURED_SPAN_KERNELS(suffix##_bc, DEPTH_TEST, DEPTH_WRITE, true)
+
+DEFINE_SPAN_KERNELS(test_write, true, true)
+DEFINE_SPAN_KERNELS(test, true, false)
+DEFINE_SPAN_KERNELS(write, false, true)
+DEFINE_SPAN_KERNELS(none, false, false)
+DEFINE_SPAN_KERNEL(draw_depth_span_scalar, true, true, SPAN_SHADE_DEPTH, TEXTURE_WRAP_ABS, TEXTURE_FILTER_NEAREST, false)
+
+// [depth test][depth write]
+static const span_kernel_t filled_span_kernels[2][2] = {
+    { draw_filled_span_none, draw_filled_span_write },
+    { draw_filled_span_test, draw_filled_span_test_write }
+};
+
+// [texture filter][lit][texture wrap] of one depth state and texture format
+#define TEXTURED_SPAN_KERNELS(suffix)                                                                                           \
+    {                                                                                                                           \
+        {                                                                                                                       \
+            { draw_textured_span_##suffix##_abs, draw_textured_span_##suffix##_repeat, draw_textured_span_##suffix##_clamp },  \
+            { draw_lit_span_##suffix##_abs, draw_lit_span_##suffix##_repeat, draw_lit_span_##suffix##_clamp }                  \
+        },                                                                                                                      \
+        {                                                                                                                       \
+            { draw_bilinear_span_##suffix##_abs, draw_bilinear_span_##suffix##_repeat, draw_bilinear_span_##suffix##_clamp },  \
+            { draw_lit_bilinear_span_##suffix##_abs, draw_lit_bilinear_span_##suffix##_repeat, draw_lit_bilinear_span_##suffix##_clamp } \
+        }                                                                                                                       \
+    }
+
+// [block compressed][depth test][depth write][texture filter][lit][texture wrap]
+static const span_kernel_t textured_span_kernels[2][2][2][2][2][3] = {
+    {
+        { TEXTURED_SPAN_KERNELS(none), TEXTURED_SPAN_KERNELS(write) },
+        { TEXTURED_SPAN_KERNELS(test), TEXTURED_SPAN_KERNELS(test_write) }
+    },
+    {
+        { TEXTURED_SPAN_KERNELS(none_bc), TEXTURED_SPAN_KERNELS(write_bc) },
+        { TEXTURED_SPAN_KERNELS(test_bc), TEXTURED_SPAN_KERNELS(test_write_bc) }
     }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
+};
+
+
+#ifdef CPU_X86_KERNELS
+// vector kernels process 4, 8 or 16 pixels of a span at once and leave the last partial
+// group of pixels to the scalar kernel (AVX-512 uses masked loads and stores instead)
+
+__attribute__((target("sse2")))
+static void draw_filled_span_sse2(const span_t* span, int first) {
+    int i = first;
+    __m128i e0 = _mm_setr_epi32(span->e0 + i * span->e0_dx, span->e0 + (i + 1) * span->e0_dx, span->e0 + (i + 2) * span->e0_dx, span->e0 + (i + 3) * span->e0_dx);
+    __m128i e1 = _mm_setr_epi32(span->e1 + i * span->e1_dx, span->e1 + (i + 1) * span->e1_dx, span->e1 + (i + 2) * span->e1_dx, span->e1 + (i + 3) * span->e1_dx);
+    __m128i e2 = _mm_setr_epi32(span->e2 + i * span->e2_dx, span->e2 + (i + 1) * span->e2_dx, span->e2 + (i + 2) * span->e2_dx, span->e2 + (i + 3) * span->e2_dx);
+    __m128i e0_step = _mm_set1_epi32(4 * span->e0_dx);
+    __m128i e1_step = _mm_set1_epi32(4 * span->e1_dx);
+    __m128i e2_step = _mm_set1_epi32(4 * span->e2_dx);
+    __m128i index = _mm_setr_epi32(i, i + 1, i + 2, i + 3);
+    __m128i color = _mm_set1_epi32(span->color);
+
+    for (; i + 4 <= span->count; i += 4) {
+        __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(e0, _mm_or_si128(e1, e2)), _mm_set1_epi32(-1));
+        __m128 reciprocal_w = _mm_add_ps(_mm_set1_ps(span->reciprocal_w), _mm_mul_ps(_mm_cvtepi32_ps(index), _mm_set1_ps(span->reciprocal_w_dx)));
+        __m128 depth = _mm_sub_ps(_mm_set1_ps(1.0f), reciprocal_w);
+        __m128 z = _mm_loadu_ps(&span->z_row[i]);
+        __m128i pass = _mm_and_si128(inside, _mm_castps_si128(_mm_cmplt_ps(depth, z)));
+
+        __m128i old_color = _mm_loadu_si128((__m128i*)&span->color_row[i]);
+        _mm_storeu_si128((__m128i*)&span->color_row[i], _mm_or_si128(_mm_and_si128(pass, color), _mm_andnot_si128(pass, old_color)));
+        _mm_storeu_si128((__m128i*)&span->z_row[i], _mm_or_si128(_mm_and_si128(pass, _mm_castps_si128(depth)), _mm_andnot_si128(pass, _mm_castps_si128(z))));
+
+        e0 = _mm_add_epi32(e0, e0_step);
+        e1 = _mm_add_epi32(e1, e1_step);
+        e2 = _mm_add_epi32(e2, e2_step);
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
     }
+    draw_filled_span_test_write(span, i);
+}
 
-    // flip v component for inverted UV-coordinates (V grows downwords)
-    v0 = 1.0 - v0;
-    v1 = 1.0 - v1;
-    v2 = 1.0 - v2;
+__attribute__((target("sse2")))
+static void draw_textured_span_sse2(const span_t* span, int first) {
+    int i = first;
+    __m128i e0 = _mm_setr_epi32(span->e0 + i * span->e0_dx, span->e0 + (i + 1) * span->e0_dx, span->e0 + (i + 2) * span->e0_dx, span->e0 + (i + 3) * span->e0_dx);
+    __m128i e1 = _mm_setr_epi32(span->e1 + i * span->e1_dx, span->e1 + (i + 1) * span->e1_dx, span->e1 + (i + 2) * span->e1_dx, span->e1 + (i + 3) * span->e1_dx);
+    __m128i e2 = _mm_setr_epi32(span->e2 + i * span->e2_dx, span->e2 + (i + 1) * span->e2_dx, span->e2 + (i + 2) * span->e2_dx, span->e2 + (i + 3) * span->e2_dx);
+    __m128i e0_step = _mm_set1_epi32(4 * span->e0_dx);
+    __m128i e1_step = _mm_set1_epi32(4 * span->e1_dx);
+    __m128i e2_step = _mm_set1_epi32(4 * span->e2_dx);
+    __m128i index = _mm_setr_epi32(i, i + 1, i + 2, i + 3);
+
+    for (; i + 4 <= span->count; i += 4) {
+        __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(e0, _mm_or_si128(e1, e2)), _mm_set1_epi32(-1));
+        __m128 lane_index = _mm_cvtepi32_ps(index);
+        __m128 reciprocal_w = _mm_add_ps(_mm_set1_ps(span->reciprocal_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->reciprocal_w_dx)));
+        __m128 depth = _mm_sub_ps(_mm_set1_ps(1.0f), reciprocal_w);
+        __m128 z = _mm_loadu_ps(&span->z_row[i]);
+        __m128i pass = _mm_and_si128(inside, _mm_castps_si128(_mm_cmplt_ps(depth, z)));
+        int pass_mask = _mm_movemask_ps(_mm_castsi128_ps(pass));
+
+        if (pass_mask != 0) {
+            __m128 u = _mm_div_ps(_mm_add_ps(_mm_set1_ps(span->u_over_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->u_over_w_dx))), reciprocal_w);
+            __m128 v = _mm_div_ps(_mm_add_ps(_mm_set1_ps(span->v_over_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->v_over_w_dx))), reciprocal_w);
+            int tex_x[4], tex_y[4];
+            _mm_storeu_si128((__m128i*)tex_x, _mm_cvttps_epi32(_mm_mul_ps(u, _mm_set1_ps((float)span->texture.width))));
+            _mm_storeu_si128((__m128i*)tex_y, _mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps((float)span->texture.height))));
+
+            // SSE2 has no gather, texels are fetched one lane at a time
+            for (int lane = 0; lane < 4; lane++) {
+                if (pass_mask & (1 << lane)) {
+                    span->color_row[i + lane] = get_span_texel(span, tex_x[lane], tex_y[lane]);
+                }
+            }
+            _mm_storeu_si128((__m128i*)&span->z_row[i], _mm_or_si128(_mm_and_si128(pass, _mm_castps_si128(depth)), _mm_andnot_si128(pass, _mm_castps_si128(z))));
+        }
 
-    // create vector points and texture coords after sorting the vertices
-    vec4_t point_a = { x0, y0, z0, w0 };
-    vec4_t point_b = { x1, y1, z1, w1 };
-    vec4_t point_c = { x2, y2, z2, w2 };
-    tex2_t a_uv = { u0, v0 };
-    tex2_t b_uv = { u1, v1 };
-    tex2_t c_uv = { u2, v2 };
+        e0 = _mm_add_epi32(e0, e0_step);
+        e1 = _mm_add_epi32(e1, e1_step);
+        e2 = _mm_add_epi32(e2, e2_step);
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    draw_textured_span_test_write_abs(span, i);
+}
 
-    // render upper part of triangle (flat-bottom)
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
+__attribute__((target("sse2")))
+static inline __m128i lerp_texels_sse2(__m128i a, __m128i b, __m128i weight) {
+    __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(256), weight);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, inverse), _mm_mullo_epi16(b, weight)), 8);
+}
 
-    if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+// bilinear kernels blend texels as 8 channels of 16 bits per register, 2 pixels at a time,
+// with the 32 bit weight of every pixel repeated over its 4 channels:
+//
+//   weights   w0 w1 w2 w3  ->  w0 w0 w0 w0 w1 w1 w1 w1  (pixels 0 and 1)
+//                              w2 w2 w2 w2 w3 w3 w3 w3  (pixels 2 and 3)
+//
+__attribute__((target("sse2")))
+static void draw_bilinear_span_sse2(const span_t* span, int first) {
+    int i = first;
+    __m128i e0 = _mm_setr_epi32(span->e0 + i * span->e0_dx, span->e0 + (i + 1) * span->e0_dx, span->e0 + (i + 2) * span->e0_dx, span->e0 + (i + 3) * span->e0_dx);
+    __m128i e1 = _mm_setr_epi32(span->e1 + i * span->e1_dx, span->e1 + (i + 1) * span->e1_dx, span->e1 + (i + 2) * span->e1_dx, span->e1 + (i + 3) * span->e1_dx);
+    __m128i e2 = _mm_setr_epi32(span->e2 + i * span->e2_dx, span->e2 + (i + 1) * span->e2_dx, span->e2 + (i + 2) * span->e2_dx, span->e2 + (i + 3) * span->e2_dx);
+    __m128i e0_step = _mm_set1_epi32(4 * span->e0_dx);
+    __m128i e1_step = _mm_set1_epi32(4 * span->e1_dx);
+    __m128i e2_step = _mm_set1_epi32(4 * span->e2_dx);
+    __m128i index = _mm_setr_epi32(i, i + 1, i + 2, i + 3);
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= span->count; i += 4) {
+        __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(e0, _mm_or_si128(e1, e2)), _mm_set1_epi32(-1));
+        __m128 lane_index = _mm_cvtepi32_ps(index);
+        __m128 reciprocal_w = _mm_add_ps(_mm_set1_ps(span->reciprocal_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->reciprocal_w_dx)));
+        __m128 depth = _mm_sub_ps(_mm_set1_ps(1.0f), reciprocal_w);
+        __m128 z = _mm_loadu_ps(&span->z_row[i]);
+        __m128i pass = _mm_and_si128(inside, _mm_castps_si128(_mm_cmplt_ps(depth, z)));
+        int pass_mask = _mm_movemask_ps(_mm_castsi128_ps(pass));
+
+        if (pass_mask != 0) {
+            __m128 u = _mm_div_ps(_mm_add_ps(_mm_set1_ps(span->u_over_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->u_over_w_dx))), reciprocal_w);
+            __m128 v = _mm_div_ps(_mm_add_ps(_mm_set1_ps(span->v_over_w), _mm_mul_ps(lane_index, _mm_set1_ps(span->v_over_w_dx))), reciprocal_w);
+            __m128 s = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps((float)span->texture.width)), _mm_set1_ps(0.5f));
+            __m128 t = _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps((float)span->texture.height)), _mm_set1_ps(0.5f));
+
+            // SSE2 has no floor, truncation rounds negative coordinates up by one
+            __m128i x0 = _mm_cvttps_epi32(s);
+            __m128i y0 = _mm_cvttps_epi32(t);
+            __m128 is_x_up = _mm_cmpgt_ps(_mm_cvtepi32_ps(x0), s);
+            __m128 is_y_up = _mm_cmpgt_ps(_mm_cvtepi32_ps(y0), t);
+            x0 = _mm_add_epi32(x0, _mm_castps_si128(is_x_up));
+            y0 = _mm_add_epi32(y0, _mm_castps_si128(is_y_up));
+            __m128i fx = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(s, _mm_cvtepi32_ps(x0)), _mm_set1_ps(256.0f)));
+            __m128i fy = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(y0)), _mm_set1_ps(256.0f)));
+
+            // mirror negative coordinates and wrap them like get_span_texel()
+            __m128i x1 = _mm_add_epi32(x0, _mm_set1_epi32(1));
+            __m128i y1 = _mm_add_epi32(y0, _mm_set1_epi32(1));
+            int tex_x0[4], tex_x1[4], tex_y0[4], tex_y1[4];
+            _mm_storeu_si128((__m128i*)tex_x0, _mm_and_si128(_mm_sub_epi32(_mm_xor_si128(x0, _mm_srai_epi32(x0, 31)), _mm_srai_epi32(x0, 31)), _mm_set1_epi32(span->texture.width_mask)));
+            _mm_storeu_si128((__m128i*)tex_x1, _mm_and_si128(_mm_sub_epi32(_mm_xor_si128(x1, _mm_srai_epi32(x1, 31)), _mm_srai_epi32(x1, 31)), _mm_set1_epi32(span->texture.width_mask)));
+            _mm_storeu_si128((__m128i*)tex_y0, _mm_and_si128(_mm_sub_epi32(_mm_xor_si128(y0, _mm_srai_epi32(y0, 31)), _mm_srai_epi32(y0, 31)), _mm_set1_epi32(span->texture.height_mask)));
+            _mm_storeu_si128((__m128i*)tex_y1, _mm_and_si128(_mm_sub_epi32(_mm_xor_si128(y1, _mm_srai_epi32(y1, 31)), _mm_srai_epi32(y1, 31)), _mm_set1_epi32(span->texture.height_mask)));
+
+            // SSE2 has no gather, the 16 texels are fetched one at a time
+            uint32_t a[4], b[4], c[4], d[4];
+            for (int lane = 0; lane < 4; lane++) {
+                a[lane] = get_texel(&span->texture, tex_x0[lane], tex_y0[lane]);
+                b[lane] = get_texel(&span->texture, tex_x1[lane], tex_y0[lane]);
+                c[lane] = get_texel(&span->texture, tex_x0[lane], tex_y1[lane]);
+                d[lane] = get_texel(&span->texture, tex_x1[lane], tex_y1[lane]);
+            }
+            __m128i texels_a = _mm_loadu_si128((__m128i*)a);
+            __m128i texels_b = _mm_loadu_si128((__m128i*)b);
+            __m128i texels_c = _mm_loadu_si128((__m128i*)c);
+            __m128i texels_d = _mm_loadu_si128((__m128i*)d);
+
+            __m128i wx = _mm_packs_epi32(fx, fx);
+            __m128i wy = _mm_packs_epi32(fy, fy);
+            wx = _mm_unpacklo_epi16(wx, wx);
+            wy = _mm_unpacklo_epi16(wy, wy);
+            __m128i wx_low = _mm_unpacklo_epi32(wx, wx), wx_high = _mm_unpackhi_epi32(wx, wx);
+            __m128i wy_low = _mm_unpacklo_epi32(wy, wy), wy_high = _mm_unpackhi_epi32(wy, wy);
+
+            __m128i top_low = lerp_texels_sse2(_mm_unpacklo_epi8(texels_a, zero), _mm_unpacklo_epi8(texels_b, zero), wx_low);
+            __m128i top_high = lerp_texels_sse2(_mm_unpackhi_epi8(texels_a, zero), _mm_unpackhi_epi8(texels_b, zero), wx_high);
+            __m128i bottom_low = lerp_texels_sse2(_mm_unpacklo_epi8(texels_c, zero), _mm_unpacklo_epi8(texels_d, zero), wx_low);
+            __m128i bottom_high = lerp_texels_sse2(_mm_unpackhi_epi8(texels_c, zero), _mm_unpackhi_epi8(texels_d, zero), wx_high);
+            __m128i color = _mm_packus_epi16(lerp_texels_sse2(top_low, bottom_low, wy_low), lerp_texels_sse2(top_high, bottom_high, wy_high));
+
+            __m128i old_color = _mm_loadu_si128((__m128i*)&span->color_row[i]);
+            _mm_storeu_si128((__m128i*)&span->color_row[i], _mm_or_si128(_mm_and_si128(pass, color), _mm_andnot_si128(pass, old_color)));
+            _mm_storeu_si128((__m128i*)&span->z_row[i], _mm_or_si128(_mm_and_si128(pass, _mm_castps_si128(depth)), _mm_andnot_si128(pass, _mm_castps_si128(z))));
+        }
 
-    if (y1 - y0 != 0) {
-        for (int y = y0; y <= y1; y++) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+        e0 = _mm_add_epi32(e0, e0_step);
+        e1 = _mm_add_epi32(e1, e1_step);
+        e2 = _mm_add_epi32(e2, e2_step);
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    draw_bilinear_span_test_write_abs(span, i);
+}
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+__attribute__((target("sse2")))
+static void draw_depth_span_sse2(const span_t* span, int first) {
+    int i = first;
+    __m128i e0 = _mm_setr_epi32(span->e0 + i * span->e0_dx, span->e0 + (i + 1) * span->e0_dx, span->e0 + (i + 2) * span->e0_dx, span->e0 + (i + 3) * span->e0_dx);
+    __m128i e1 = _mm_setr_epi32(span->e1 + i * span->e1_dx, span->e1 + (i + 1) * span->e1_dx, span->e1 + (i + 2) * span->e1_dx, span->e1 + (i + 3) * span->e1_dx);
+    __m128i e2 = _mm_setr_epi32(span->e2 + i * span->e2_dx, span->e2 + (i + 1) * span->e2_dx, span->e2 + (i + 2) * span->e2_dx, span->e2 + (i + 3) * span->e2_dx);
+    __m128i e0_step = _mm_set1_epi32(4 * span->e0_dx);
+    __m128i e1_step = _mm_set1_epi32(4 * span->e1_dx);
+    __m128i e2_step = _mm_set1_epi32(4 * span->e2_dx);
+    __m128i index = _mm_setr_epi32(i, i + 1, i + 2, i + 3);
+
+    for (; i + 4 <= span->count; i += 4) {
+        __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(e0, _mm_or_si128(e1, e2)), _mm_set1_epi32(-1));
+        __m128 reciprocal_w = _mm_add_ps(_mm_set1_ps(span->reciprocal_w), _mm_mul_ps(_mm_cvtepi32_ps(index), _mm_set1_ps(span->reciprocal_w_dx)));
+        __m128 depth = _mm_sub_ps(_mm_set1_ps(1.0f), reciprocal_w);
+        __m128 z = _mm_loadu_ps(&span->z_row[i]);
+        __m128i pass = _mm_and_si128(inside, _mm_castps_si128(_mm_cmplt_ps(depth, z)));
+
+        _mm_storeu_si128((__m128i*)&span->z_row[i], _mm_or_si128(_mm_and_si128(pass, _mm_castps_si128(depth)), _mm_andnot_si128(pass, _mm_castps_si128(z))));
+        *span->depth_writes += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(pass)));
+
+        e0 = _mm_add_epi32(e0, e0_step);
+        e1 = _mm_add_epi32(e1, e1_step);
+        e2 = _mm_add_epi32(e2, e2_step);
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    draw_depth_span_scalar(span, i);
+}
+
+__attribute__((target("avx2")))
+static void draw_filled_span_avx2(const span_t* span, int first) {
+    int i = first;
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(span->e0), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e0_dx)));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(span->e1), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e1_dx)));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(span->e2), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e2_dx)));
+    __m256i e0_step = _mm256_set1_epi32(8 * span->e0_dx);
+    __m256i e1_step = _mm256_set1_epi32(8 * span->e1_dx);
+    __m256i e2_step = _mm256_set1_epi32(8 * span->e2_dx);
+    __m256 color = _mm256_castsi256_ps(_mm256_set1_epi32(span->color));
+
+    for (; i + 8 <= span->count; i += 8) {
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(e0, _mm256_or_si256(e1, e2)), _mm256_set1_epi32(-1));
+        __m256 reciprocal_w = _mm256_add_ps(_mm256_set1_ps(span->reciprocal_w), _mm256_mul_ps(_mm256_cvtepi32_ps(index), _mm256_set1_ps(span->reciprocal_w_dx)));
+        __m256 depth = _mm256_sub_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+        __m256 z = _mm256_loadu_ps(&span->z_row[i]);
+        __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(depth, z, _CMP_LT_OQ));
+
+        __m256 old_color = _mm256_loadu_ps((float*)&span->color_row[i]);
+        _mm256_storeu_ps((float*)&span->color_row[i], _mm256_blendv_ps(old_color, color, pass));
+        _mm256_storeu_ps(&span->z_row[i], _mm256_blendv_ps(z, depth, pass));
+
+        e0 = _mm256_add_epi32(e0, e0_step);
+        e1 = _mm256_add_epi32(e1, e1_step);
+        e2 = _mm256_add_epi32(e2, e2_step);
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    // the compiler leaves out vzeroupper before tail calls, without it the scalar SSE code stalls
+    _mm256_zeroupper();
+    draw_filled_span_test_write(span, i);
+}
+
+__attribute__((target("avx2")))
+static void draw_textured_span_avx2(const span_t* span, int first) {
+    int i = first;
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(span->e0), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e0_dx)));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(span->e1), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e1_dx)));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(span->e2), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e2_dx)));
+    __m256i e0_step = _mm256_set1_epi32(8 * span->e0_dx);
+    __m256i e1_step = _mm256_set1_epi32(8 * span->e1_dx);
+    __m256i e2_step = _mm256_set1_epi32(8 * span->e2_dx);
+
+    for (; i + 8 <= span->count; i += 8) {
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(e0, _mm256_or_si256(e1, e2)), _mm256_set1_epi32(-1));
+        __m256 lane_index = _mm256_cvtepi32_ps(index);
+        __m256 reciprocal_w = _mm256_add_ps(_mm256_set1_ps(span->reciprocal_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->reciprocal_w_dx)));
+        __m256 depth = _mm256_sub_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+        __m256 z = _mm256_loadu_ps(&span->z_row[i]);
+        __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(depth, z, _CMP_LT_OQ));
+        int pass_mask = _mm256_movemask_ps(pass);
+
+        if (pass_mask != 0) {
+            __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(span->u_over_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->u_over_w_dx))), reciprocal_w);
+            __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(span->v_over_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->v_over_w_dx))), reciprocal_w);
+            int tex_x[8], tex_y[8];
+            _mm256_storeu_si256((__m256i*)tex_x, _mm256_cvttps_epi32(_mm256_mul_ps(u, _mm256_set1_ps((float)span->texture.width))));
+            _mm256_storeu_si256((__m256i*)tex_y, _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps((float)span->texture.height))));
+
+            for (int lane = 0; lane < 8; lane++) {
+                if (pass_mask & (1 << lane)) {
+                    span->color_row[i + lane] = get_span_texel(span, tex_x[lane], tex_y[lane]);
+                }
             }
+            _mm256_storeu_ps(&span->z_row[i], _mm256_blendv_ps(z, depth, pass));
+        }
+
+        e0 = _mm256_add_epi32(e0, e0_step);
+        e1 = _mm256_add_epi32(e1, e1_step);
+        e2 = _mm256_add_epi32(e2, e2_step);
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    // the compiler leaves out vzeroupper before tail calls, without it the scalar SSE code stalls
+    _mm256_zeroupper();
+    draw_textured_span_test_write_abs(span, i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lerp_texels_avx2(__m256i a, __m256i b, __m256i weight) {
+    __m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(256), weight);
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, inverse), _mm256_mullo_epi16(b, weight)), 8);
+}
+
+// same blend as the SSE2 kernel on both 128 bit halves, so "low" holds pixels 0, 1, 4, 5
+// and "high" pixels 2, 3, 6, 7; packing puts them back in order; texel offsets and texels
+// are gathered 8 at a time
+__attribute__((target("avx2")))
+static void draw_bilinear_span_avx2(const span_t* span, int first) {
+    int i = first;
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(span->e0), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e0_dx)));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(span->e1), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e1_dx)));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(span->e2), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e2_dx)));
+    __m256i e0_step = _mm256_set1_epi32(8 * span->e0_dx);
+    __m256i e1_step = _mm256_set1_epi32(8 * span->e1_dx);
+    __m256i e2_step = _mm256_set1_epi32(8 * span->e2_dx);
+    __m256i zero = _mm256_setzero_si256();
+    const int* texels = (const int*)span->texture.texels;
+
+    for (; i + 8 <= span->count; i += 8) {
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(e0, _mm256_or_si256(e1, e2)), _mm256_set1_epi32(-1));
+        __m256 lane_index = _mm256_cvtepi32_ps(index);
+        __m256 reciprocal_w = _mm256_add_ps(_mm256_set1_ps(span->reciprocal_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->reciprocal_w_dx)));
+        __m256 depth = _mm256_sub_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+        __m256 z = _mm256_loadu_ps(&span->z_row[i]);
+        __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(depth, z, _CMP_LT_OQ));
+
+        if (_mm256_movemask_ps(pass) != 0) {
+            __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(span->u_over_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->u_over_w_dx))), reciprocal_w);
+            __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(span->v_over_w), _mm256_mul_ps(lane_index, _mm256_set1_ps(span->v_over_w_dx))), reciprocal_w);
+            __m256 s = _mm256_sub_ps(_mm256_mul_ps(u, _mm256_set1_ps((float)span->texture.width)), _mm256_set1_ps(0.5f));
+            __m256 t = _mm256_sub_ps(_mm256_mul_ps(v, _mm256_set1_ps((float)span->texture.height)), _mm256_set1_ps(0.5f));
+            __m256 floor_s = _mm256_floor_ps(s);
+            __m256 floor_t = _mm256_floor_ps(t);
+            __m256i fx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(s, floor_s), _mm256_set1_ps(256.0f)));
+            __m256i fy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(t, floor_t), _mm256_set1_ps(256.0f)));
+
+            // mirror negative coordinates and wrap them like get_span_texel()
+            __m256i x0 = _mm256_cvttps_epi32(floor_s);
+            __m256i y0 = _mm256_cvttps_epi32(floor_t);
+            __m256i width_mask = _mm256_set1_epi32(span->texture.width_mask);
+            __m256i height_mask = _mm256_set1_epi32(span->texture.height_mask);
+            __m256i tex_x0 = _mm256_and_si256(_mm256_abs_epi32(x0), width_mask);
+            __m256i tex_x1 = _mm256_and_si256(_mm256_abs_epi32(_mm256_add_epi32(x0, _mm256_set1_epi32(1))), width_mask);
+            __m256i tex_y0 = _mm256_and_si256(_mm256_abs_epi32(y0), height_mask);
+            __m256i tex_y1 = _mm256_and_si256(_mm256_abs_epi32(_mm256_add_epi32(y0, _mm256_set1_epi32(1))), height_mask);
+
+            __m256i x0_offset = _mm256_i32gather_epi32(span->texture.x_offsets, tex_x0, 4);
+            __m256i x1_offset = _mm256_i32gather_epi32(span->texture.x_offsets, tex_x1, 4);
+            __m256i y0_offset = _mm256_i32gather_epi32(span->texture.y_offsets, tex_y0, 4);
+            __m256i y1_offset = _mm256_i32gather_epi32(span->texture.y_offsets, tex_y1, 4);
+            __m256i texels_a = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x0_offset, y0_offset), 4);
+            __m256i texels_b = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x1_offset, y0_offset), 4);
+            __m256i texels_c = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x0_offset, y1_offset), 4);
+            __m256i texels_d = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x1_offset, y1_offset), 4);
+
+            __m256i wx = _mm256_packs_epi32(fx, fx);
+            __m256i wy = _mm256_packs_epi32(fy, fy);
+            wx = _mm256_unpacklo_epi16(wx, wx);
+            wy = _mm256_unpacklo_epi16(wy, wy);
+            __m256i wx_low = _mm256_unpacklo_epi32(wx, wx), wx_high = _mm256_unpackhi_epi32(wx, wx);
+            __m256i wy_low = _mm256_unpacklo_epi32(wy, wy), wy_high = _mm256_unpackhi_epi32(wy, wy);
+
+            __m256i top_low = lerp_texels_avx2(_mm256_unpacklo_epi8(texels_a, zero), _mm256_unpacklo_epi8(texels_b, zero), wx_low);
+            __m256i top_high = lerp_texels_avx2(_mm256_unpackhi_epi8(texels_a, zero), _mm256_unpackhi_epi8(texels_b, zero), wx_high);
+            __m256i bottom_low = lerp_texels_avx2(_mm256_unpacklo_epi8(texels_c, zero), _mm256_unpacklo_epi8(texels_d, zero), wx_low);
+            __m256i bottom_high = lerp_texels_avx2(_mm256_unpackhi_epi8(texels_c, zero), _mm256_unpackhi_epi8(texels_d, zero), wx_high);
+            __m256i color = _mm256_packus_epi16(lerp_texels_avx2(top_low, bottom_low, wy_low), lerp_texels_avx2(top_high, bottom_high, wy_high));
+
+            __m256 old_color = _mm256_loadu_ps((float*)&span->color_row[i]);
+            _mm256_storeu_ps((float*)&span->color_row[i], _mm256_blendv_ps(old_color, _mm256_castsi256_ps(color), pass));
+            _mm256_storeu_ps(&span->z_row[i], _mm256_blendv_ps(z, depth, pass));
+        }
+
+        e0 = _mm256_add_epi32(e0, e0_step);
+        e1 = _mm256_add_epi32(e1, e1_step);
+        e2 = _mm256_add_epi32(e2, e2_step);
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    // the compiler leaves out vzeroupper before tail calls, without it the scalar SSE code stalls
+    _mm256_zeroupper();
+    draw_bilinear_span_test_write_abs(span, i);
+}
+
+__attribute__((target("avx2")))
+static void draw_depth_span_avx2(const span_t* span, int first) {
+    int i = first;
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(span->e0), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e0_dx)));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(span->e1), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e1_dx)));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(span->e2), _mm256_mullo_epi32(index, _mm256_set1_epi32(span->e2_dx)));
+    __m256i e0_step = _mm256_set1_epi32(8 * span->e0_dx);
+    __m256i e1_step = _mm256_set1_epi32(8 * span->e1_dx);
+    __m256i e2_step = _mm256_set1_epi32(8 * span->e2_dx);
+
+    for (; i + 8 <= span->count; i += 8) {
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(e0, _mm256_or_si256(e1, e2)), _mm256_set1_epi32(-1));
+        __m256 reciprocal_w = _mm256_add_ps(_mm256_set1_ps(span->reciprocal_w), _mm256_mul_ps(_mm256_cvtepi32_ps(index), _mm256_set1_ps(span->reciprocal_w_dx)));
+        __m256 depth = _mm256_sub_ps(_mm256_set1_ps(1.0f), reciprocal_w);
+        __m256 z = _mm256_loadu_ps(&span->z_row[i]);
+        __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(depth, z, _CMP_LT_OQ));
+
+        _mm256_storeu_ps(&span->z_row[i], _mm256_blendv_ps(z, depth, pass));
+        *span->depth_writes += __builtin_popcount(_mm256_movemask_ps(pass));
+
+        e0 = _mm256_add_epi32(e0, e0_step);
+        e1 = _mm256_add_epi32(e1, e1_step);
+        e2 = _mm256_add_epi32(e2, e2_step);
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    // the compiler leaves out vzeroupper before tail calls, without it the scalar SSE code stalls
+    _mm256_zeroupper();
+    draw_depth_span_scalar(span, i);
+}
+
+__attribute__((target("avx512f")))
+static void draw_filled_span_avx512(const span_t* span, int first) {
+    __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i color = _mm512_set1_epi32(span->color);
+
+    for (int i = first; i < span->count; i += 16) {
+        // the last group of a span only loads and stores the pixels that belong to it
+        int remaining = span->count - i;
+        __mmask16 valid = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+        __m512i e0 = _mm512_add_epi32(_mm512_set1_epi32(span->e0), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e0_dx)));
+        __m512i e1 = _mm512_add_epi32(_mm512_set1_epi32(span->e1), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e1_dx)));
+        __m512i e2 = _mm512_add_epi32(_mm512_set1_epi32(span->e2), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e2_dx)));
+        __mmask16 inside = _mm512_mask_cmpgt_epi32_mask(valid, _mm512_or_si512(e0, _mm512_or_si512(e1, e2)), _mm512_set1_epi32(-1));
+
+        __m512 reciprocal_w = _mm512_add_ps(_mm512_set1_ps(span->reciprocal_w), _mm512_mul_ps(_mm512_cvtepi32_ps(index), _mm512_set1_ps(span->reciprocal_w_dx)));
+        __m512 depth = _mm512_sub_ps(_mm512_set1_ps(1.0f), reciprocal_w);
+        __m512 z = _mm512_maskz_loadu_ps(valid, &span->z_row[i]);
+        __mmask16 pass = _mm512_mask_cmp_ps_mask(inside, depth, z, _CMP_LT_OQ);
+
+        _mm512_mask_storeu_epi32(&span->color_row[i], pass, color);
+        _mm512_mask_storeu_ps(&span->z_row[i], pass, depth);
+    }
+}
 
-            for (int x = x_start; x < x_end; x++) {
-                // draw pixel with color that comes from texture
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+__attribute__((target("avx512f")))
+static void draw_textured_span_avx512(const span_t* span, int first) {
+    __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    for (int i = first; i < span->count; i += 16) {
+        int remaining = span->count - i;
+        __mmask16 valid = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+        __m512i e0 = _mm512_add_epi32(_mm512_set1_epi32(span->e0), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e0_dx)));
+        __m512i e1 = _mm512_add_epi32(_mm512_set1_epi32(span->e1), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e1_dx)));
+        __m512i e2 = _mm512_add_epi32(_mm512_set1_epi32(span->e2), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e2_dx)));
+        __mmask16 inside = _mm512_mask_cmpgt_epi32_mask(valid, _mm512_or_si512(e0, _mm512_or_si512(e1, e2)), _mm512_set1_epi32(-1));
+
+        __m512 lane_index = _mm512_cvtepi32_ps(index);
+        __m512 reciprocal_w = _mm512_add_ps(_mm512_set1_ps(span->reciprocal_w), _mm512_mul_ps(lane_index, _mm512_set1_ps(span->reciprocal_w_dx)));
+        __m512 depth = _mm512_sub_ps(_mm512_set1_ps(1.0f), reciprocal_w);
+        __m512 z = _mm512_maskz_loadu_ps(valid, &span->z_row[i]);
+        __mmask16 pass = _mm512_mask_cmp_ps_mask(inside, depth, z, _CMP_LT_OQ);
+
+        if (pass != 0) {
+            __m512 u = _mm512_div_ps(_mm512_add_ps(_mm512_set1_ps(span->u_over_w), _mm512_mul_ps(lane_index, _mm512_set1_ps(span->u_over_w_dx))), reciprocal_w);
+            __m512 v = _mm512_div_ps(_mm512_add_ps(_mm512_set1_ps(span->v_over_w), _mm512_mul_ps(lane_index, _mm512_set1_ps(span->v_over_w_dx))), reciprocal_w);
+            int tex_x[16], tex_y[16];
+            _mm512_storeu_si512(tex_x, _mm512_cvttps_epi32(_mm512_mul_ps(u, _mm512_set1_ps((float)span->texture.width))));
+            _mm512_storeu_si512(tex_y, _mm512_cvttps_epi32(_mm512_mul_ps(v, _mm512_set1_ps((float)span->texture.height))));
+
+            for (int bit = 0; bit < 16; bit++) {
+                if (pass & (1 << bit)) {
+                    span->color_row[i + bit] = get_span_texel(span, tex_x[bit], tex_y[bit]);
+                }
             }
+            _mm512_mask_storeu_ps(&span->z_row[i], pass, depth);
         }
     }
+}
+
+__attribute__((target("avx512f")))
+static void draw_depth_span_avx512(const span_t* span, int first) {
+    __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    for (int i = first; i < span->count; i += 16) {
+        int remaining = span->count - i;
+        __mmask16 valid = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+        __m512i e0 = _mm512_add_epi32(_mm512_set1_epi32(span->e0), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e0_dx)));
+        __m512i e1 = _mm512_add_epi32(_mm512_set1_epi32(span->e1), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e1_dx)));
+        __m512i e2 = _mm512_add_epi32(_mm512_set1_epi32(span->e2), _mm512_mullo_epi32(index, _mm512_set1_epi32(span->e2_dx)));
+        __mmask16 inside = _mm512_mask_cmpgt_epi32_mask(valid, _mm512_or_si512(e0, _mm512_or_si512(e1, e2)), _mm512_set1_epi32(-1));
+
+        __m512 reciprocal_w = _mm512_add_ps(_mm512_set1_ps(span->reciprocal_w), _mm512_mul_ps(_mm512_cvtepi32_ps(index), _mm512_set1_ps(span->reciprocal_w_dx)));
+        __m512 depth = _mm512_sub_ps(_mm512_set1_ps(1.0f), reciprocal_w);
+        __m512 z = _mm512_maskz_loadu_ps(valid, &span->z_row[i]);
+        __mmask16 pass = _mm512_mask_cmp_ps_mask(inside, depth, z, _CMP_LT_OQ);
+
+        _mm512_mask_storeu_ps(&span->z_row[i], pass, depth);
+        *span->depth_writes += __builtin_popcount(pass);
+    }
+}
+#endif
+
+
+// ----- DEPTH RANGE OF A TRIANGLE FOR HIERARCHICAL Z TESTS -----
+// depth 1 - 1/w is interpolated linearly, so its extremes are at the vertices; the margin
+// covers rounding of per pixel interpolation, tests stay conservative and never change pixels
+#define HZ_DEPTH_MARGIN 1e-5f
+
+typedef struct {
+    float min_depth;
+    float max_depth;
+} depth_range_t;
+
+// blocks are only skipped while the depth test is on, and only lowered while depth is
+// also written; both are set with the span kernels of the frame
+static bool is_hz_test = true;
+static bool is_hz_update = true;
+
+static depth_range_t get_triangle_depth_range(float w0, float w1, float w2) {
+    float d0 = 1.0f - 1 / w0;
+    float d1 = 1.0f - 1 / w1;
+    float d2 = 1.0f - 1 / w2;
+    depth_range_t range = {
+        .min_depth = (d0 < d1 ? (d0 < d2 ? d0 : d2) : (d1 < d2 ? d1 : d2)) - HZ_DEPTH_MARGIN,
+        .max_depth = (d0 > d1 ? (d0 > d2 ? d0 : d2) : (d1 > d2 ? d1 : d2)) + HZ_DEPTH_MARGIN
+    };
+    return range;
+}
 
-    // render bottom part of triangle (flat-top)
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
 
-    if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+// ----- TEST IF EVERY PIXEL OF A BLOCK IS INSIDE THE TRIANGLE -----
+// the triangle is convex, so it holds all pixels of a block when it holds the four corners
+static bool is_block_covered(const edge_setup_t* edges, int x0, int y0, int x1, int y1) {
+    int corners_x[4] = { x0, x1, x0, x1 };
+    int corners_y[4] = { y0, y0, y1, y1 };
+    for (int i = 0; i < 4; i++) {
+        int dx = corners_x[i] - edges->min_x;
+        int dy = corners_y[i] - edges->min_y;
+        int e0 = edges->e0 + dx * edges->e0_dx + dy * edges->e0_dy;
+        int e1 = edges->e1 + dx * edges->e1_dx + dy * edges->e1_dy;
+        int e2 = edges->e2 + dx * edges->e2_dx + dy * edges->e2_dy;
+        if ((e0 | e1 | e2) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; y++) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+// ----- DRAW SPANS OF A TRIANGLE, SKIPPING BLOCKS HIDDEN IN THE HIERARCHICAL Z-BUFFER -----
+// rows are walked in bands of HZ_BLOCK_SIZE rows; blocks whose max depth is not farther than
+// the nearest point of the triangle can not receive any pixel and are skipped, so triangles
+// behind existing geometry cost one compare per block; blocks fully covered by the triangle
+// afterwards hold no depth farther than its farthest point, which lowers their max depth
+//
+//        +-------+-------+-------+-------+
+//        |  skip | draw  | draw  |       |
+//        |      /|\      |       |       |
+//        +-----/-+-\-----+-------+-------+
+//        | draw /|covered \ draw |       |
+//        |     / |  (max  |\     |       |
+//        +----/--+-lowered)+-\---+-------+
+//
+static void draw_triangle_spans(
+    const edge_setup_t* edges, depth_range_t depth, span_t* span, span_kernel_t draw_span,
+    attribute_setup_t reciprocal_w, attribute_setup_t u_over_w, attribute_setup_t v_over_w,
+    uint32_t* color_buffer
+) {
+    float* z_buffer = get_z_buffer();
+    float* hz_buffer = get_hz_buffer();
+    int window_width = get_window_width();
+    int hz_width = get_hz_width();
+
+    int min_bx = edges->min_x / HZ_BLOCK_SIZE;
+    int max_bx = edges->max_x / HZ_BLOCK_SIZE;
+    int count = edges->max_x - edges->min_x + 1;
+
+    for (int by = edges->min_y / HZ_BLOCK_SIZE; by <= edges->max_y / HZ_BLOCK_SIZE; by++) {
+        float* hz_row = &hz_buffer[hz_width * by];
+        int min_y = (by * HZ_BLOCK_SIZE > edges->min_y) ? by * HZ_BLOCK_SIZE : edges->min_y;
+        int max_y = (by * HZ_BLOCK_SIZE + HZ_BLOCK_SIZE - 1 < edges->max_y) ? by * HZ_BLOCK_SIZE + HZ_BLOCK_SIZE - 1 : edges->max_y;
+
+        int bx = min_bx;
+        while (bx <= max_bx) {
+            if (is_hz_test && depth.min_depth >= hz_row[bx]) {
+                bx++;
+                continue;
             }
 
-            for (int x = x_start; x < x_end; x++) {
-                // draw pixel with color that comes from texture
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+            // run of neighbouring blocks that may be visible, drawn as one piece of every span
+            int run_min_bx = bx;
+            while (bx <= max_bx && (!is_hz_test || depth.min_depth < hz_row[bx])) {
+                bx++;
+            }
+            int first = run_min_bx * HZ_BLOCK_SIZE - edges->min_x;
+            int last = bx * HZ_BLOCK_SIZE - 1 - edges->min_x;
+            span->count = (last + 1 < count) ? last + 1 : count;
+
+            for (int y = min_y; y <= max_y; y++) {
+                int row = y - edges->min_y;
+
+                // edge functions are exact integers, interpolated attributes restart at every row;
+                // spans keep starting at min_x so skipped blocks do not change any pixel value
+                span->color_row = &color_buffer[(window_width * y) + edges->min_x];
+                span->z_row = &z_buffer[(window_width * y) + edges->min_x];
+                span->e0 = edges->e0 + row * edges->e0_dy;
+                span->e1 = edges->e1 + row * edges->e1_dy;
+                span->e2 = edges->e2 + row * edges->e2_dy;
+                span->reciprocal_w = reciprocal_w.value + row * reciprocal_w.dy;
+                span->u_over_w = u_over_w.value + row * u_over_w.dy;
+                span->v_over_w = v_over_w.value + row * v_over_w.dy;
+
+                draw_span(span, first > 0 ? first : 0);
+            }
+        }
+
+        // lower max depth of blocks fully covered by the triangle, blocks on the window border may be partial
+        for (int b = min_bx; is_hz_update && b <= max_bx; b++) {
+            if (depth.max_depth >= hz_row[b]) {
+                continue;
+            }
+            int x0 = b * HZ_BLOCK_SIZE;
+            int y0 = by * HZ_BLOCK_SIZE;
+            int x1 = (x0 + HZ_BLOCK_SIZE - 1 < get_window_width()) ? x0 + HZ_BLOCK_SIZE - 1 : get_window_width() - 1;
+            int y1 = (y0 + HZ_BLOCK_SIZE - 1 < get_window_height()) ? y0 + HZ_BLOCK_SIZE - 1 : get_window_height() - 1;
+            if (x0 >= edges->min_x && x1 <= edges->max_x && y0 >= edges->min_y && y1 <= edges->max_y && is_block_covered(edges, x0, y0, x1, y1)) {
+                hz_row[b] = depth.max_depth;
             }
         }
     }
 }
 
 
-// ----- DRAW FILLED TRIANGLE WITH FLAT_TOP/FLAT_BOTTOM METHOD
-// split the original triangle in two, half flat-bottom and half flat-top
+// ----- SELECT SPAN KERNELS FOR THE INSTRUCTION SET OF CURRENT CPU -----
+void init_triangle_kernels(void) {
+    draw_filled_span_vector = draw_filled_span_test_write;
+    draw_textured_span_vector = draw_textured_span_test_write_abs;
+    draw_bilinear_span_vector = draw_bilinear_span_test_write_abs;
+    draw_depth_span = draw_depth_span_scalar;
+#ifdef CPU_X86_KERNELS
+    switch (get_cpu_isa()) {
+        case CPU_ISA_AVX512:
+            draw_filled_span_vector = draw_filled_span_avx512;
+            draw_textured_span_vector = draw_textured_span_avx512;
+            draw_bilinear_span_vector = draw_bilinear_span_avx2;
+            draw_depth_span = draw_depth_span_avx512;
+            break;
+        case CPU_ISA_AVX2:
+            draw_filled_span_vector = draw_filled_span_avx2;
+            draw_textured_span_vector = draw_textured_span_avx2;
+            draw_bilinear_span_vector = draw_bilinear_span_avx2;
+            draw_depth_span = draw_depth_span_avx2;
+            break;
+        case CPU_ISA_SSE2:
+            draw_filled_span_vector = draw_filled_span_sse2;
+            draw_textured_span_vector = draw_textured_span_sse2;
+            draw_bilinear_span_vector = draw_bilinear_span_sse2;
+            draw_depth_span = draw_depth_span_sse2;
+            break;
+    }
+#endif
+    draw_id_span = draw_filled_span_vector;
+    select_span_kernels();
+}
+
+
+// ----- SELECT SPAN KERNELS FOR THE RENDER STATE OF THE NEXT BATCH OF TRIANGLES -----
+// called before the tiles of a frame are drawn, so the state is looked up once per frame
+// instead of once per pixel; the default state (depth test and write, unlit, abs wrap) keeps
+// the vector kernels, every other state gets its specialized scalar kernel; subdivided
+// spans and spans of block compressed textures always take the scalar kernel of the state,
+// the vector kernels divide every pixel and read RGBA32 texels
+void select_span_kernels(void) {
+    int depth_test = is_depth_test_enabled();
+    int depth_write = is_depth_write_enabled();
+    int filter = get_texture_filter();
+    int lit = should_light_textures();
+    int wrap = get_texture_wrap();
+
+    bool is_default_depth = depth_test && depth_write;
+    bool is_default_texture = is_default_depth && !lit && wrap == TEXTURE_WRAP_ABS;
+    span_kernel_t draw_span_vector = (filter == TEXTURE_FILTER_BILINEAR) ? draw_bilinear_span_vector : draw_textured_span_vector;
+
+    draw_filled_span = is_default_depth ? draw_filled_span_vector : filled_span_kernels[depth_test][depth_write];
+    draw_textured_span = is_default_texture ? draw_span_vector : textured_span_kernels[0][depth_test][depth_write][filter][lit][wrap];
+    draw_subdivided_span = textured_span_kernels[0][depth_test][depth_write][filter][lit][wrap];
+    draw_compressed_span = textured_span_kernels[1][depth_test][depth_write][filter][lit][wrap];
+    is_hz_test = depth_test;
+    is_hz_update = depth_test && depth_write;
+}
+
+
+// ----- MIPMAP LEVEL THAT MATCHES THE SIZE OF A TRIANGLE ON SCREEN -----
+// the ratio of the triangle area in texels to its area in pixels is the number of texels
+// one pixel covers on average; a level halves both sides, so log2 of the texels covered
+// along one side, rounded, is the level whose texels are closest to one per pixel
 //
-//          (x0,y0)
-//            / \
-//           /   \
-//          /     \
-//         /       \
-//        /         \
-//   (x1,y1)---------\
-//       \_           \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                         (x2,y2)
+//   level 0: 4x4 texels per pixel    level 2: 1 texel per pixel
+//   +-+-+-+-+
+//   +-+-+-+-+                        +-------+
+//   +-+-+-+-+            ->          |       |
+//   +-+-+-+-+                        +-------+
 //
-void draw_filled_triangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t color
+static int get_triangle_mip_level(
+    const texture_t* texture,
+    float x0, float y0, float u0, float v0,
+    float x1, float y1, float u1, float v1,
+    float x2, float y2, float u2, float v2
+) {
+    float pixel_area = fabsf((x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0));
+    float texel_area = fabsf((u1 - u0) * (v2 - v0) - (u2 - u0) * (v1 - v0)) * texture->width * texture->height;
+    if (texel_area <= pixel_area) {
+        return 0;
+    }
+    int level = (int)(0.5f * log2f(texel_area / pixel_area) + 0.5f);
+    return (level < texture->num_mipmaps) ? level : texture->num_mipmaps;
+}
+
+
+// ----- SETUP OF A TEXTURED TRIANGLE BEFORE ITS PIXELS ARE WALKED -----
+// shared by the forward path and the visibility buffer shading pass, so both compute
+// exactly the same texture coordinates for every pixel
+typedef struct textured_setup {
+    edge_setup_t edges;
+    attribute_setup_t reciprocal_w;
+    attribute_setup_t u_over_w;
+    attribute_setup_t v_over_w;
+    depth_range_t depth;
+    span_t span;                      // fields that are the same for every span of the triangle
+} textured_setup_t;
+
+static bool setup_textured_triangle(
+    textured_setup_t* setup,
+    float x0, float y0, float w0, float u0, float v0,
+    float x1, float y1, float w1, float u1, float v1,
+    float x2, float y2, float w2, float u2, float v2,
+    const texture_t* texture, float light_intensity, rect_t clip
 ) {
-    // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
+    // make vertices counter-clockwise so that inside pixels have positive edge functions
+    if (get_fixed_triangle_area(x0, y0, x1, y1, x2, y2) < 0) {
+        float_swap(&x1, &x2);
+        float_swap(&y1, &y2);
         float_swap(&w1, &w2);
+        float_swap(&u1, &u2);
+        float_swap(&v1, &v2);
     }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+
+    if (!setup_triangle_edges(&setup->edges, x0, y0, x1, y1, x2, y2, clip)) {
+        return false;
     }
 
-    // create three vector points after sorting vertices
-    vec4_t point_a = { x0, y0, z0, w0 };
-    vec4_t point_b = { x1, y1, z1, w1 };
-    vec4_t point_c = { x2, y2, z2, w2 };
+    // flip v component for inverted UV-coordinates (V grows downwords)
+    v0 = 1.0 - v0;
+    v1 = 1.0 - v1;
+    v2 = 1.0 - v2;
 
-    // render upper part of triangle (flat-bottom)
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
+    // perspective correct interpolation is linear in 1/w, U/w, and V/w
+    setup->reciprocal_w = setup_triangle_attribute(&setup->edges, 1 / w0, 1 / w1, 1 / w2);
+    setup->u_over_w = setup_triangle_attribute(&setup->edges, u0 / w0, u1 / w1, u2 / w2);
+    setup->v_over_w = setup_triangle_attribute(&setup->edges, v0 / w0, v1 / w1, v2 / w2);
+    setup->depth = get_triangle_depth_range(w0, w1, w2);
+
+    // one mipmap level for the whole triangle, its descriptor is copied once per triangle
+    // and kernels read it next to the other span fields
+    int mip_level = 0;
+    if (is_mipmapping_enabled()) {
+        mip_level = get_triangle_mip_level(texture, x0, y0, u0, v0, x1, y1, u1, v1, x2, y2, u2, v2);
+    }
 
-    if (y1 - y0 != 0) inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+    span_t span = {
+        .e0_dx = setup->edges.e0_dx,
+        .e1_dx = setup->edges.e1_dx,
+        .e2_dx = setup->edges.e2_dx,
+        .reciprocal_w_dx = setup->reciprocal_w.dx,
+        .u_over_w_dx = setup->u_over_w.dx,
+        .v_over_w_dx = setup->v_over_w.dx,
+        .texture = *get_texture_level(texture, mip_level),
+        .light_intensity = light_intensity
+    };
+    setup->span = span;
+    return true;
+}
 
-    if (y1 - y0 != 0) {
-        for (int y = y0; y <= y1; y++) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-            }
+// ----- DRAW TEXTURED TRIANGLE BASED ON TEXTURE ARRAY OF COLORS -----
+// walk the bounding box of the triangle and draw every pixel where all three
+// edge functions are non-negative, one span kernel call per row of every run of blocks
+// that is not hidden in the hierarchical z-buffer
+//
+//    min_x               max_x
+//   +----------------------+ min_y
+//   |        v0            |
+//   |        /\            |
+//   |       /  \  outside  |
+//   |      /    \          |
+//   |    v1--____\         |
+//   |            v2        |
+//   +----------------------+ max_y
+//
+void draw_textured_triangle(
+    float x0, float y0, float w0, float u0, float v0,
+    float x1, float y1, float w1, float u1, float v1,
+    float x2, float y2, float w2, float u2, float v2,
+    const texture_t* texture, float light_intensity, rect_t clip
+) {
+    textured_setup_t setup;
+    if (!setup_textured_triangle(&setup, x0, y0, w0, u0, v0, x1, y1, w1, u1, v1, x2, y2, w2, u2, v2, texture, light_intensity, clip)) {
+        return;
+    }
 
-            for (int x = x_start; x < x_end; x++) {
-                // Draw our pixel with a solid color
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-            }
-        }
+    // exact divide per pixel by default, one divide every 8 or 16 pixels when subdivided
+    setup.span.subdivision = get_span_subdivision();
+    span_kernel_t draw_span = (setup.span.subdivision > 1) ? draw_subdivided_span : draw_textured_span;
+    if (setup.span.texture.format != TEXTURE_FORMAT_RGBA32) {
+        draw_span = draw_compressed_span;
+    }
+    draw_triangle_spans(
+        &setup.edges, setup.depth, &setup.span, draw_span,
+        setup.reciprocal_w, setup.u_over_w, setup.v_over_w, get_color_buffer()
+    );
+}
+
+
+// ----- SETUP SHARED BY TRIANGLES THAT ONLY INTERPOLATE DEPTH -----
+// filled, depth-only and id triangles walk the same pixels with the same 1/w, so the depth
+// of every pixel is bit for bit the same in the pre-pass, the visibility buffer and forward
+// shading; callers add the fields their kernel reads to the span
+typedef struct {
+    edge_setup_t edges;
+    attribute_setup_t reciprocal_w;
+    depth_range_t depth;
+    span_t span;
+} depth_setup_t;
+
+static bool setup_depth_triangle(
+    depth_setup_t* setup,
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    rect_t clip
+) {
+    // make vertices counter-clockwise so that inside pixels have positive edge functions
+    if (get_fixed_triangle_area(x0, y0, x1, y1, x2, y2) < 0) {
+        float_swap(&x1, &x2);
+        float_swap(&y1, &y2);
+        float_swap(&w1, &w2);
+    }
+
+    if (!setup_triangle_edges(&setup->edges, x0, y0, x1, y1, x2, y2, clip)) {
+        return false;
     }
 
-    // render bottom part of triangle (flat-top)
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+    setup->reciprocal_w = setup_triangle_attribute(&setup->edges, 1 / w0, 1 / w1, 1 / w2);
+    setup->depth = get_triangle_depth_range(w0, w1, w2);
+
+    span_t span = {
+        .e0_dx = setup->edges.e0_dx,
+        .e1_dx = setup->edges.e1_dx,
+        .e2_dx = setup->edges.e2_dx,
+        .reciprocal_w_dx = setup->reciprocal_w.dx
+    };
+    setup->span = span;
+    return true;
+}
 
-    if (y2 - y1 != 0) inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0) inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+static void draw_depth_triangle_spans(depth_setup_t* setup, span_kernel_t draw_span, uint32_t* buffer) {
+    // these triangles have no texture coordinates to interpolate
+    attribute_setup_t no_attribute = { 0 };
+    draw_triangle_spans(&setup->edges, setup->depth, &setup->span, draw_span, setup->reciprocal_w, no_attribute, no_attribute, buffer);
+}
+
+
+// ----- DRAW FILLED TRIANGLE WITH EDGE FUNCTIONS OVER ITS BOUNDING BOX -----
+// same traversal as the textured triangle, only 1/w is interpolated for the depth test
+void draw_filled_triangle(
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    uint32_t color, rect_t clip
+) {
+    depth_setup_t setup;
+    if (!setup_depth_triangle(&setup, x0, y0, w0, x1, y1, w1, x2, y2, w2, clip)) {
+        return;
+    }
+    setup.span.color = color;
+    draw_depth_triangle_spans(&setup, draw_filled_span, get_color_buffer());
+}
+
+
+// ----- WRITE DEPTH OF A TRIANGLE WITHOUT SHADING IT, FOR THE DEPTH PRE-PASS -----
+// depth_writes counts pixels that passed the test
+void draw_triangle_depth(
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    int* depth_writes, rect_t clip
+) {
+    depth_setup_t setup;
+    if (!setup_depth_triangle(&setup, x0, y0, w0, x1, y1, w1, x2, y2, w2, clip)) {
+        return;
+    }
+    setup.span.depth_writes = depth_writes;
+    draw_depth_triangle_spans(&setup, draw_depth_span, get_color_buffer());
+}
 
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; y++) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+// ----- WRITE DEPTH AND TRIANGLE ID OF A TRIANGLE TO THE VISIBILITY BUFFER -----
+// the filled span kernels do the work, with the id as color and the id buffer as target;
+// they always test and write depth, whatever the render state of the frame
+void draw_triangle_id(
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    uint32_t id, rect_t clip
+) {
+    depth_setup_t setup;
+    if (!setup_depth_triangle(&setup, x0, y0, w0, x1, y1, w1, x2, y2, w2, clip)) {
+        return;
+    }
+    setup.span.color = id;
+    draw_depth_triangle_spans(&setup, draw_id_span, get_id_buffer());
+}
+
+
+// ----- SHADE EVERY PIXEL OF THE VISIBILITY BUFFER INSIDE A TILE -----
+// ids in the buffer are 1 + the position of the triangle in the list drawn to the tile,
+// 0 where no triangle was drawn; the setup of a triangle is built the first time one of
+// its pixels is met and reused for the rest of them, in the scratch of the tile that only
+// grows when the tile shades more triangles than ever before; texture coordinates of a pixel
+// are evaluated from the start of its row like the span kernels do, so the shaded image is
+// the same as forward rendering
+//
+//    id buffer             triangles[]            color buffer
+//   +-------------+       +------------+        +-------------+
+//   | 0 0 1 1 2 2 | ----> | 0: ...     | -----> | . . # # @ @ |
+//   | 0 1 1 2 2 2 |       | 1: uv, tex |        | . # # @ @ @ |
+//   +-------------+       +------------+        +-------------+
+//
+void shade_visibility_buffer(
+    const triangle_t* triangles, const int* triangle_indices, int num_triangles,
+    bool is_textured, rect_t clip, shading_scratch_t* scratch
+) {
+    uint32_t* color_buffer = get_color_buffer();
+    uint32_t* id_buffer = get_id_buffer();
+    int window_width = get_window_width();
+    int wrap = get_texture_wrap();
+    bool is_bilinear = get_texture_filter() == TEXTURE_FILTER_BILINEAR;
+    bool is_lit = should_light_textures();
+
+    if (is_textured && num_triangles > scratch->capacity) {
+        int capacity = (scratch->capacity == 0) ? 64 : scratch->capacity;
+        while (capacity < num_triangles) {
+            capacity *= 2;
+        }
+        textured_setup_t* setups = (textured_setup_t*)realloc(scratch->setups, sizeof(textured_setup_t) * capacity);
+        if (setups != NULL) {
+            scratch->setups = setups;
+        }
+        bool* is_setup_ready = (bool*)realloc(scratch->is_setup_ready, sizeof(bool) * capacity);
+        if (is_setup_ready != NULL) {
+            scratch->is_setup_ready = is_setup_ready;
+        }
+        if (setups == NULL || is_setup_ready == NULL) {
+            return;    // out of memory, the tile keeps its cleared color
+        }
+        scratch->capacity = capacity;
+    }
+    textured_setup_t* setups = scratch->setups;
+    bool* is_setup_ready = scratch->is_setup_ready;
+    if (is_textured) {
+        memset(is_setup_ready, 0, sizeof(bool) * num_triangles);
+    }
+
+    for (int y = clip.min_y; y <= clip.max_y; y++) {
+        for (int x = clip.min_x; x <= clip.max_x; x++) {
+            uint32_t id = id_buffer[(window_width * y) + x];
+            if (id == 0) {
+                continue;
+            }
+            int index = id - 1;
+            const triangle_t* triangle = &triangles[triangle_indices[index]];
+
+            // flat shaded triangles already carry their lit color
+            if (!is_textured) {
+                color_buffer[(window_width * y) + x] = triangle->color;
+                continue;
             }
 
-            for (int x = x_start; x < x_end; x++) {
-                // Draw our pixel with a solid color
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+            textured_setup_t* setup = &setups[index];
+            if (!is_setup_ready[index]) {
+                setup_textured_triangle(
+                    setup,
+                    triangle->points[0].x, triangle->points[0].y, triangle->points[0].w, triangle->texcoords[0].u, triangle->texcoords[0].v,
+                    triangle->points[1].x, triangle->points[1].y, triangle->points[1].w, triangle->texcoords[1].u, triangle->texcoords[1].v,
+                    triangle->points[2].x, triangle->points[2].y, triangle->points[2].w, triangle->texcoords[2].u, triangle->texcoords[2].v,
+                    triangle->texture, triangle->light_intensity, clip
+                );
+                is_setup_ready[index] = true;
             }
+
+            int row = y - setup->edges.min_y;
+            float i = (float)(x - setup->edges.min_x);
+            float reciprocal_w = (setup->reciprocal_w.value + row * setup->reciprocal_w.dy) + i * setup->reciprocal_w.dx;
+            float u = ((setup->u_over_w.value + row * setup->u_over_w.dy) + i * setup->u_over_w.dx) / reciprocal_w;
+            float v = ((setup->v_over_w.value + row * setup->v_over_w.dy) + i * setup->v_over_w.dx) / reciprocal_w;
+
+            const texture_t* texture = &setup->span.texture;
+            bool is_compressed = texture->format != TEXTURE_FORMAT_RGBA32;
+            uint32_t texel;
+            if (is_bilinear) {
+                texel = sample_bilinear(texture, u * (float)texture->width, v * (float)texture->height, wrap, is_compressed);
+            } else {
+                int tex_x = wrap_texel_coordinate(u * (float)texture->width, texture->width_mask, wrap);
+                int tex_y = wrap_texel_coordinate(v * (float)texture->height, texture->height_mask, wrap);
+                texel = fetch_texel(texture, tex_x, tex_y, is_compressed);
+            }
+            color_buffer[(window_width * y) + x] = is_lit ? light_apply_intensity(texel, setup->span.light_intensity) : texel;
         }
     }
 }
 
 
+void free_shading_scratch(shading_scratch_t* scratch) {
+    free(scratch->setups);
+    free(scratch->is_setup_ready);
+    scratch->setups = NULL;
+    scratch->is_setup_ready = NULL;
+    scratch->capacity = 0;
+}
+
+
 vec3_t get_triangle_normal(vec4_t vertices[3]) {
 
     // get vectors from A,B,C to calculate normal
@@ -2,9 +2,9 @@
 #define TRIANGLE_H
 
 #include <stdint.h>
+#include "display.h"
 #include "texture.h"
 #include "vector.h"
-#include "upng.h"
 
 typedef struct {
     int a;
@@ -20,24 +20,56 @@ typedef struct {
     vec4_t points[3];
     tex2_t texcoords[3];
     uint32_t color;
-    upng_t* texture;
+    float light_intensity;
+    texture_t* texture;
 } triangle_t;
 
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void init_triangle_kernels(void);
+void select_span_kernels(void);
+
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, rect_t clip);
 
 void draw_filled_triangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t color
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    uint32_t color, rect_t clip
 );
 
 void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
+    float x0, float y0, float w0, float u0, float v0,
+    float x1, float y1, float w1, float u1, float v1,
+    float x2, float y2, float w2, float u2, float v2,
+    const texture_t* texture, float light_intensity, rect_t clip
+);
+
+void draw_triangle_depth(
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    int* depth_writes, rect_t clip
+);
+
+void draw_triangle_id(
+    float x0, float y0, float w0,
+    float x1, float y1, float w1,
+    float x2, float y2, float w2,
+    uint32_t id, rect_t clip
+);
+
+// setups of the triangles a tile shades from its visibility buffer, kept by the tile from
+// one frame to the next and only grown, so the shading pass does not allocate
+typedef struct {
+    struct textured_setup* setups;
+    bool* is_setup_ready;
+    int capacity;
+} shading_scratch_t;
+
+void shade_visibility_buffer(
+    const triangle_t* triangles, const int* triangle_indices, int num_triangles,
+    bool is_textured, rect_t clip, shading_scratch_t* scratch
 );
+void free_shading_scratch(shading_scratch_t* scratch);
 
 vec3_t get_triangle_normal(vec4_t vertices[3]);
 
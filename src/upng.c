@@ -30,6 +30,11 @@ freely, subject to the following restrictions:
 #include <limits.h>
 
 #include "upng.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #define MAKE_BYTE(b) ((b) & 0xFF)
 #define MAKE_DWORD(a,b,c,d) ((MAKE_BYTE(a) << 24) | (MAKE_BYTE(b) << 16) | (MAKE_BYTE(c) << 8) | MAKE_BYTE(d))
@@ -688,6 +693,91 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+#ifdef CPU_X86_KERNELS
+/*
+   vector versions of the "up" and "sub" filters, which are the common filters of RGBA textures.
+   they return how many bytes were done, the caller finishes the rest with the scalar loops.
+   byte additions wrap around exactly like the unsigned char additions of the scalar code.
+ */
+__attribute__((target("sse2")))
+static unsigned long unfilter_up_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i;
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&scanline[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&precon[i]);
+		_mm_storeu_si128((__m128i *)&recon[i], _mm_add_epi8(a, b));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static unsigned long unfilter_up_avx2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i;
+	for (i = 0; i + 32 <= length; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)&scanline[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&precon[i]);
+		_mm256_storeu_si256((__m256i *)&recon[i], _mm256_add_epi8(a, b));
+	}
+	return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long unfilter_up_avx512(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i;
+	for (i = 0; i + 64 <= length; i += 64) {
+		__m512i a = _mm512_loadu_si512(&scanline[i]);
+		__m512i b = _mm512_loadu_si512(&precon[i]);
+		_mm512_storeu_si512(&recon[i], _mm512_add_epi8(a, b));
+	}
+	return i;
+}
+
+/* sub filter with 4 bytes per pixel: prefix sum of 4 pixels per register, carrying the last pixel into the next register */
+__attribute__((target("sse2")))
+static unsigned long unfilter_sub4_sse2(unsigned char *recon, const unsigned char *scanline, unsigned long length)
+{
+	unsigned long i;
+	__m128i last = _mm_setzero_si128();
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&scanline[i]);
+		a = _mm_add_epi8(a, _mm_slli_si128(a, 4));
+		a = _mm_add_epi8(a, _mm_slli_si128(a, 8));
+		a = _mm_add_epi8(a, last);
+		_mm_storeu_si128((__m128i *)&recon[i], a);
+		last = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	return i;
+}
+#endif
+
+static unsigned long unfilter_up_simd(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+#ifdef CPU_X86_KERNELS
+	switch (get_cpu_isa()) {
+	case CPU_ISA_AVX512:
+		return unfilter_up_avx512(recon, scanline, precon, length);
+	case CPU_ISA_AVX2:
+		return unfilter_up_avx2(recon, scanline, precon, length);
+	case CPU_ISA_SSE2:
+		return unfilter_up_sse2(recon, scanline, precon, length);
+	}
+#endif
+	return 0;
+}
+
+static unsigned long unfilter_sub_simd(unsigned char *recon, const unsigned char *scanline, unsigned long bytewidth, unsigned long length)
+{
+#ifdef CPU_X86_KERNELS
+	/* every instruction set above scalar has sse2 */
+	if (bytewidth == 4 && get_cpu_isa() != CPU_ISA_SCALAR)
+		return unfilter_sub4_sse2(recon, scanline, length);
+#endif
+	return 0;
+}
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
 {
 	/*
@@ -705,14 +795,15 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 			recon[i] = scanline[i];
 		break;
 	case 1:
-		for (i = 0; i < bytewidth; i++)
+		i = unfilter_sub_simd(recon, scanline, bytewidth, length);
+		for (; i < bytewidth; i++)
 			recon[i] = scanline[i];
-		for (i = bytewidth; i < length; i++)
+		for (; i < length; i++)
 			recon[i] = scanline[i] + recon[i - bytewidth];
 		break;
 	case 2:
 		if (precon)
-			for (i = 0; i < length; i++)
+			for (i = unfilter_up_simd(recon, scanline, precon, length); i < length; i++)
 				recon[i] = scanline[i] + precon[i];
 		else
 			for (i = 0; i < length; i++)
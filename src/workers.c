@@ -0,0 +1,105 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+#include "workers.h"
+
+// the calling thread always works as well, so only num_workers - 1 threads are spawned
+static SDL_Thread* threads[MAX_NUM_WORKERS];
+static int num_workers = 1;
+
+static SDL_sem* start_semaphore = NULL;
+static SDL_sem* done_semaphore = NULL;
+
+// current batch of jobs shared by all workers
+static job_function_t current_job_function = NULL;
+static void* current_job_data = NULL;
+static int current_num_jobs = 0;
+static SDL_atomic_t next_job_index;
+static bool is_quitting = false;
+
+
+// ----- GRAB JOB INDICES UNTIL THE CURRENT BATCH IS EXHAUSTED -----
+static void run_jobs(void) {
+    while (true) {
+        int job_index = SDL_AtomicAdd(&next_job_index, 1);
+        if (job_index >= current_num_jobs) {
+            break;
+        }
+        current_job_function(job_index, current_job_data);
+    }
+}
+
+
+static int worker_thread(void* data) {
+    while (true) {
+        // sleep until a new batch of jobs is started
+        SDL_SemWait(start_semaphore);
+        if (is_quitting) {
+            break;
+        }
+        run_jobs();
+        SDL_SemPost(done_semaphore);
+    }
+    return 0;
+}
+
+
+// ----- SPAWN WORKER THREADS, num_workers <= 0 USES ONE WORKER PER CPU CORE -----
+void init_workers(int count) {
+    // allow overriding number of workers from environment, e.g. RENDERER_WORKERS=1 for serial rendering
+    char* workers_env = SDL_getenv("RENDERER_WORKERS");
+    if (workers_env != NULL) {
+        count = atoi(workers_env);
+    }
+    if (count <= 0) count = SDL_GetCPUCount();
+    if (count > MAX_NUM_WORKERS) count = MAX_NUM_WORKERS;
+
+    num_workers = count;
+    is_quitting = false;
+    start_semaphore = SDL_CreateSemaphore(0);
+    done_semaphore = SDL_CreateSemaphore(0);
+
+    for (int i = 1; i < num_workers; i++) {
+        threads[i] = SDL_CreateThread(worker_thread, "worker", NULL);
+    }
+}
+
+
+int get_num_workers(void) {
+    return num_workers;
+}
+
+
+// ----- RUN job_function FOR ALL JOB INDICES AND WAIT UNTIL EVERY JOB IS DONE -----
+void run_parallel_jobs(int num_jobs, job_function_t job_function, void* data) {
+    current_job_function = job_function;
+    current_job_data = data;
+    current_num_jobs = num_jobs;
+    SDL_AtomicSet(&next_job_index, 0);
+
+    // wake up helper threads only if there is more than one job to share
+    int num_helpers = (num_jobs > 1) ? num_workers - 1 : 0;
+    for (int i = 0; i < num_helpers; i++) {
+        SDL_SemPost(start_semaphore);
+    }
+
+    run_jobs();
+
+    for (int i = 0; i < num_helpers; i++) {
+        SDL_SemWait(done_semaphore);
+    }
+}
+
+
+void destroy_workers(void) {
+    is_quitting = true;
+    for (int i = 1; i < num_workers; i++) {
+        SDL_SemPost(start_semaphore);
+    }
+    for (int i = 1; i < num_workers; i++) {
+        SDL_WaitThread(threads[i], NULL);
+    }
+    SDL_DestroySemaphore(start_semaphore);
+    SDL_DestroySemaphore(done_semaphore);
+    num_workers = 1;
+}
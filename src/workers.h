@@ -0,0 +1,14 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#define MAX_NUM_WORKERS 64
+
+// job callback, called once for every index in [0, num_jobs)
+typedef void (*job_function_t)(int job_index, void* data);
+
+void init_workers(int num_workers);
+int get_num_workers(void);
+void run_parallel_jobs(int num_jobs, job_function_t job_function, void* data);
+void destroy_workers(void);
+
+#endif